@@ -0,0 +1,148 @@
+/*
+* Measures objects that are all freed together, freed one at a time
+* with free() against given back at once with arena_reset().
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -o bench_arena bench_arena.c our_malloc.c ../page_source.c -lpthread
+*
+* A record is split into fields of a few dozen bytes that live until
+* the next record, as in gawk's reset_record(). A pool holds many more
+* objects for longer, as the bytecode that free_bcpool() frees.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "our_malloc.h"
+
+#define RECORDS			200000
+#define MAXIMUM_FIELDS		64
+#define POOLS			20
+#define POOL_OBJECTS		100000
+
+static void * objects[POOL_OBJECTS];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Size of the next field or object, 16 to 127 bytes
+static size_t next_size(unsigned int * seed)
+{
+	return 16 + rand_r(seed) % 112;
+}
+
+static void fill(char * object, size_t size)
+{
+	object[0] = 1;
+	object[size - 1] = 1;
+}
+
+static double records_with_free()
+{
+	unsigned int seed = 1;
+	size_t count = 0;
+	int record, i;
+	double start = now_ns();
+
+	for ( record = 0; record < RECORDS; record++ ) {
+		int fields = 1 + rand_r(&seed) % MAXIMUM_FIELDS;
+
+		for ( i = 0; i < fields; i++ ) {
+			size_t size = next_size(&seed);
+
+			objects[i] = malloc(size);
+			fill(objects[i], size);
+		}
+
+		for ( i = 0; i < fields; i++ )
+			free(objects[i]);
+
+		count += fields;
+	}
+
+	return (now_ns() - start) / count;
+}
+
+static double records_with_arena()
+{
+	malloc_arena * arena = arena_create(0);
+	unsigned int seed = 1;
+	size_t count = 0;
+	int record, i;
+	double start = now_ns();
+
+	for ( record = 0; record < RECORDS; record++ ) {
+		int fields = 1 + rand_r(&seed) % MAXIMUM_FIELDS;
+
+		for ( i = 0; i < fields; i++ ) {
+			size_t size = next_size(&seed);
+
+			objects[i] = arena_alloc(arena, size);
+			fill(objects[i], size);
+		}
+
+		arena_reset(arena);
+		count += fields;
+	}
+
+	double elapsed = now_ns() - start;
+
+	arena_destroy(arena);
+	return elapsed / count;
+}
+
+static double pools_with_free()
+{
+	unsigned int seed = 1;
+	int pool, i;
+	double start = now_ns();
+
+	for ( pool = 0; pool < POOLS; pool++ ) {
+		for ( i = 0; i < POOL_OBJECTS; i++ ) {
+			size_t size = next_size(&seed);
+
+			objects[i] = malloc(size);
+			fill(objects[i], size);
+		}
+
+		for ( i = 0; i < POOL_OBJECTS; i++ )
+			free(objects[i]);
+	}
+
+	return (now_ns() - start) / ((double) POOLS * POOL_OBJECTS);
+}
+
+static double pools_with_arena()
+{
+	unsigned int seed = 1;
+	int pool, i;
+	double start = now_ns();
+
+	for ( pool = 0; pool < POOLS; pool++ ) {
+		malloc_arena * arena = arena_create(0);
+
+		for ( i = 0; i < POOL_OBJECTS; i++ ) {
+			size_t size = next_size(&seed);
+
+			objects[i] = arena_alloc(arena, size);
+			fill(objects[i], size);
+		}
+
+		arena_destroy(arena);
+	}
+
+	return (now_ns() - start) / ((double) POOLS * POOL_OBJECTS);
+}
+
+int main()
+{
+	printf("%12s %12s %12s\n", "ns/object", "free", "arena");
+	printf("%12s %12.1f %12.1f\n", "records", records_with_free(), records_with_arena());
+	printf("%12s %12.1f %12.1f\n", "pools", pools_with_free(), pools_with_arena());
+
+	return 0;
+}
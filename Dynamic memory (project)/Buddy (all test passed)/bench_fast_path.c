@@ -0,0 +1,57 @@
+/*
+* Measures the malloc/free fast path for requests that are
+* served by buddy blocks, one request size at a time.
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -o bench_fast_path bench_fast_path.c our_malloc.c ../page_source.c -lpthread
+*
+* Every size is first warmed up so that the blocks come out of
+* the cache of the thread, what is left is mostly the mapping
+* from size to order and the table lookups of free.
+*/
+#include <stdio.h>
+#include <time.h>
+
+#include "our_malloc.h"
+
+#define ITERATIONS		2000000
+
+static const size_t request_sizes[] = { 300, 700, 1000, 3000, 20000, 300000 };
+
+// Keeps the compiler from eliding the malloc/free pairs.
+static void * volatile sink;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+	size_t k;
+
+	printf("%12s %12s\n", "size", "ns/op");
+
+	for ( k = 0; k < sizeof(request_sizes) / sizeof(request_sizes[0]); k++ ) {
+		size_t size = request_sizes[k];
+		size_t i;
+
+		sink = malloc(size);
+		free(sink);
+
+		double start = now_ns();
+
+		for ( i = 0; i < ITERATIONS; i++ ) {
+			sink = malloc(size);
+			free(sink);
+		}
+
+		double elapsed = now_ns() - start;
+
+		printf("%12zu %12.1f\n", size, elapsed / ITERATIONS);
+	}
+
+	return 0;
+}
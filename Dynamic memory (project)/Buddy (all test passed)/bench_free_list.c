@@ -0,0 +1,65 @@
+/*
+* Measures the cost of a malloc/free pair as the free list
+* of the requested order grows.
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -o bench_free_list bench_free_list.c our_malloc.c ../page_source.c
+*
+* With constant time unlinking the ns/op column should stay
+* flat while the free list length doubles.
+*/
+#include <stdio.h>
+#include <time.h>
+
+#include "our_malloc.h"
+
+#define REQUEST_SIZE		24
+#define ITERATIONS		200000
+#define MAXIMUM_LIST_LENGTH	16384
+
+static void * blocks[2 * MAXIMUM_LIST_LENGTH];
+
+// Keeps the compiler from eliding the malloc/free pairs.
+static void * volatile sink;
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main()
+{
+	size_t length;
+
+	printf("%12s %12s\n", "list length", "ns/op");
+
+	for ( length = 16; length <= MAXIMUM_LIST_LENGTH; length *= 2 ) {
+		size_t i;
+
+		// Allocate buddy pairs and free every other block, the
+		// remaining halves keep the freed ones from merging.
+		for ( i = 0; i < 2 * length; i++ )
+			blocks[i] = malloc(REQUEST_SIZE);
+
+		for ( i = 1; i < 2 * length; i += 2 )
+			free(blocks[i]);
+
+		double start = now_ns();
+
+		for ( i = 0; i < ITERATIONS; i++ ) {
+			sink = malloc(REQUEST_SIZE);
+			free(sink);
+		}
+
+		double elapsed = now_ns() - start;
+
+		printf("%12zu %12.1f\n", length, elapsed / ITERATIONS);
+
+		for ( i = 0; i < 2 * length; i += 2 )
+			free(blocks[i]);
+	}
+
+	return 0;
+}
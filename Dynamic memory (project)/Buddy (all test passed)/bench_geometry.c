@@ -0,0 +1,105 @@
+/*
+* Measures how the geometry of the buddy allocator, the size of its
+* smallest block and of its arenas, fits workloads of small objects
+* and of page sized ones.
+*
+* Build together with the allocator, once per geometry:
+*	cc -O2 -fno-builtin -o bench_geometry bench_geometry.c our_malloc.c ../page_source.c -lpthread
+*	cc -O2 -fno-builtin -DMINIMUM_BLOCK_ORDER=6 -o bench_geometry bench_geometry.c our_malloc.c ../page_source.c -lpthread
+*
+* A sweep over the smallest block:
+*	for order in 5 6 7 8 9 10 12; do
+*		cc -O2 -fno-builtin -DMINIMUM_BLOCK_ORDER=$order -o bench_geometry bench_geometry.c our_malloc.c ../page_source.c -lpthread && ./bench_geometry
+*	done
+*
+* Each run replaces random objects of a live set, of one workload
+* per process so that the peak heap is its own. The smallest sizes
+* of the small objects are above the slab classes and go to the
+* buddy blocks. Waste is 1 - live bytes / bytes in use at the end,
+* the heap itself grows by whole arenas.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "our_malloc.h"
+
+#define OPERATIONS		4000000
+#define LIVE_OBJECTS		20000
+
+typedef struct workload {
+	const char * name;
+	size_t smallest;
+	size_t largest;
+} workload;
+
+static const workload workloads[] = {
+	{ "objects", 257, 2048 },
+	{ "pages", 4096, 131072 },
+};
+
+#define NUMBER_OF_WORKLOADS	(sizeof(workloads) / sizeof(workloads[0]))
+
+static char * objects[LIVE_OBJECTS];
+static size_t sizes[LIVE_OBJECTS];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const workload * work)
+{
+	unsigned int seed = 1;
+	size_t live = 0;
+	size_t i;
+	double start = now_ns();
+
+	for ( i = 0; i < OPERATIONS; i++ ) {
+		size_t slot = rand_r(&seed) % LIVE_OBJECTS;
+		size_t size = work->smallest + rand_r(&seed) % (work->largest - work->smallest + 1);
+
+		free(objects[slot]);
+		live -= sizes[slot];
+
+		objects[slot] = malloc(size);
+		objects[slot][0] = 1;
+		objects[slot][size - 1] = 1;
+		sizes[slot] = size;
+		live += size;
+	}
+
+	double elapsed = now_ns() - start;
+	malloc_statistics statistics;
+
+	malloc_get_statistics(&statistics);
+
+	printf("%12s %12.1f %14zu %14zu %8.3f\n", work->name, elapsed / OPERATIONS, live, statistics.bytes_in_use, 1.0 - (double) live / statistics.bytes_in_use);
+}
+
+int main()
+{
+	malloc_statistics statistics;
+	size_t i;
+
+	malloc_get_statistics(&statistics);
+
+	printf("smallest block %zu, arenas %zu, %zu orders\n", statistics.class_size[0], statistics.class_size[statistics.number_of_classes - 1], statistics.number_of_classes);
+	printf("%12s %12s %14s %14s %8s\n", "workload", "ns/op", "live", "in use", "waste");
+	fflush(stdout);
+
+	for ( i = 0; i < NUMBER_OF_WORKLOADS; i++ ) {
+		if ( fork() == 0 ) {
+			run(&workloads[i]);
+			return 0;
+		}
+
+		wait(NULL);
+	}
+
+	return 0;
+}
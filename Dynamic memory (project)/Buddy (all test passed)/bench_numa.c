@@ -0,0 +1,308 @@
+/*
+* Measures how many of the blocks a thread gets live on another NUMA
+* node than the thread, when the threads free each other's blocks.
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -o bench_numa bench_numa.c our_malloc.c ../page_source.c -lpthread
+*
+* Every round each thread allocates a batch of blocks, then frees the
+* batch of the next thread, which is on another node. The threads are
+* dealt to the nodes in turn.
+*
+* On a machine with several nodes the threads are bound to the CPUs
+* of their node, and the node of every block is asked of the kernel:
+*	./bench_numa 4
+*	OUR_MALLOC_NODES=1 ./bench_numa 4	# all arenas shared
+* On one node the allocator can simulate more. The pages all stay on
+* the one node then, and a block counts as remote if its arena was
+* first used by a thread of another node:
+*	OUR_MALLOC_NODES=2 ./bench_numa 4 2
+*	OUR_MALLOC_NODES=1 ./bench_numa 4 2	# all arenas shared
+* An arena given back and made again for another node still counts
+* for the first, so this is an upper bound.
+* numactl --membind=<node> holds all memory to one node, which makes
+* every block remote for the threads of the other nodes.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "our_malloc.h"
+
+#define ROUNDS			200
+#define BATCH			1024
+#define MAXIMUM_THREADS		64
+
+// The arenas of the allocator are this large and aligned to it
+#ifndef UPPER_LIMIT_ORDER
+#define UPPER_LIMIT_ORDER	23
+#endif
+
+#define ARENA_SIZE		((uintptr_t) 1 << UPPER_LIMIT_ORDER)
+#define OWNER_SLOTS		4096
+
+static const size_t request_sizes[] = { 48, 200, 700, 3000, 20000 };
+
+#define NUMBER_OF_SIZES		(sizeof(request_sizes) / sizeof(request_sizes[0]))
+
+typedef struct worker {
+	pthread_t thread;
+	int number;
+	int node;
+	size_t remote;
+	size_t counted;
+	char * blocks[BATCH];
+} worker;
+
+static worker workers[MAXIMUM_THREADS];
+static int number_of_threads;
+static int number_of_nodes;
+static int simulated;
+static pthread_barrier_t barrier;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t started = PTHREAD_COND_INITIALIZER;
+static int threads_started = 0;
+
+// The node of the first thread to get a block of each arena, for the simulation
+static uintptr_t owner_arena[OWNER_SLOTS];
+static int owner_node[OWNER_SLOTS];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int count_nodes()
+{
+	char list[128];
+	int fd = open("/sys/devices/system/node/online", O_RDONLY);
+	ssize_t length = fd < 0 ? 0 : read(fd, list, sizeof(list) - 1);
+	int highest = 0;
+
+	if ( fd >= 0 )
+		close(fd);
+
+	list[length > 0 ? length : 0] = '\0';
+
+	// The last number of a list like "0-1" is the highest
+	char * last = list;
+	char * walk;
+
+	for ( walk = list; *walk != '\0'; walk++ )
+		if ( *walk == '-' || *walk == ',' )
+			last = walk + 1;
+
+	highest = atoi(last);
+	return highest + 1;
+}
+
+// Binds the calling thread to the CPUs of a node
+static void bind_to_node(int node)
+{
+	char path[64], list[1024];
+	cpu_set_t cpus;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+	int fd = open(path, O_RDONLY);
+	ssize_t length = fd < 0 ? 0 : read(fd, list, sizeof(list) - 1);
+
+	if ( fd >= 0 )
+		close(fd);
+
+	if ( length <= 0 )
+		return;
+
+	list[length] = '\0';
+	CPU_ZERO(&cpus);
+
+	// A list like "0-15,32-47"
+	char * walk = list;
+
+	while ( *walk >= '0' && *walk <= '9' ) {
+		int first = strtol(walk, &walk, 10);
+		int last = first;
+		int cpu;
+
+		if ( *walk == '-' )
+			last = strtol(walk + 1, &walk, 10);
+
+		for ( cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++ )
+			CPU_SET(cpu, &cpus);
+
+		if ( *walk == ',' )
+			walk++;
+	}
+
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+}
+
+static int arena_owner(void * block, int node)
+{
+	uintptr_t arena = (uintptr_t) block / ARENA_SIZE;
+	size_t slot = arena % OWNER_SLOTS;
+
+	for ( ;; slot = (slot + 1) % OWNER_SLOTS ) {
+		if ( owner_arena[slot] == arena )
+			return owner_node[slot];
+
+		if ( owner_arena[slot] == 0 ) {
+			owner_node[slot] = node;
+
+			if ( __sync_bool_compare_and_swap(&owner_arena[slot], 0, arena) )
+				return node;
+
+			if ( owner_arena[slot] == arena )
+				return owner_node[slot];
+		}
+	}
+}
+
+// Counts the blocks of the batch that are on another node than the thread
+static void count_remote(worker * self)
+{
+	size_t i;
+
+	if ( simulated ) {
+		for ( i = 0; i < BATCH; i++ )
+			self->remote += arena_owner(self->blocks[i], self->node) != self->node;
+	} else {
+		void * pages[BATCH];
+		int status[BATCH];
+
+		for ( i = 0; i < BATCH; i++ )
+			pages[i] = (void*) ((uintptr_t) self->blocks[i] & ~(uintptr_t) 4095);
+
+		if ( syscall(SYS_move_pages, 0, BATCH, pages, NULL, status, 0) != 0 )
+			return;
+
+		for ( i = 0; i < BATCH; i++ )
+			self->remote += status[i] >= 0 && status[i] != self->node;
+	}
+
+	self->counted += BATCH;
+}
+
+static void * run(void * data)
+{
+	worker * self = data;
+	worker * next = &workers[(self->number + 1) % number_of_threads];
+	unsigned int seed = self->number;
+	int round;
+	size_t i;
+
+	if ( !simulated )
+		bind_to_node(self->node);
+
+	// The allocator deals the threads to the simulated nodes in the
+	// order they first call it, the main thread first
+	free(malloc(1));
+
+	pthread_mutex_lock(&start_lock);
+	threads_started++;
+	pthread_cond_signal(&started);
+	pthread_mutex_unlock(&start_lock);
+
+	pthread_barrier_wait(&barrier);
+
+	for ( round = 0; round < ROUNDS; round++ ) {
+		for ( i = 0; i < BATCH; i++ ) {
+			self->blocks[i] = malloc(request_sizes[rand_r(&seed) % NUMBER_OF_SIZES]);
+			self->blocks[i][0] = 1;
+		}
+
+		// The first round has only new memory
+		if ( round > 0 && round % 10 == 0 )
+			count_remote(self);
+
+		pthread_barrier_wait(&barrier);
+
+		for ( i = 0; i < BATCH; i++ )
+			free(next->blocks[i]);
+
+		pthread_barrier_wait(&barrier);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+	char * nodes = getenv("OUR_MALLOC_NODES");
+	int i;
+
+	number_of_threads = argc > 1 ? atoi(argv[1]) : 4;
+
+	if ( number_of_threads < 2 || number_of_threads > MAXIMUM_THREADS ) {
+		fprintf(stderr, "usage: %s threads (2 to %d) [simulated nodes]\n", argv[0], MAXIMUM_THREADS);
+		return 1;
+	}
+
+	// On one node the threads are dealt to as many simulated nodes
+	// as asked for, whether the allocator simulates them or not
+	number_of_nodes = count_nodes();
+	simulated = number_of_nodes == 1;
+
+	if ( simulated )
+		number_of_nodes = argc > 2 ? atoi(argv[2]) : nodes != NULL ? atoi(nodes) : 2;
+
+	if ( number_of_nodes < 1 )
+		number_of_nodes = 1;
+
+	// The main thread is the first of the allocator, on node 0
+	void * first = malloc(1);
+
+	if ( simulated )
+		arena_owner(first, 0);
+
+	free(first);
+
+	pthread_barrier_init(&barrier, NULL, number_of_threads + 1);
+
+	for ( i = 0; i < number_of_threads; i++ ) {
+		workers[i].number = i;
+		workers[i].node = simulated ? (i + 1) % number_of_nodes : i % number_of_nodes;
+
+		pthread_create(&workers[i].thread, NULL, run, &workers[i]);
+
+		// One at a time, so that they are dealt in this order
+		pthread_mutex_lock(&start_lock);
+		while ( threads_started <= i )
+			pthread_cond_wait(&started, &start_lock);
+		pthread_mutex_unlock(&start_lock);
+	}
+
+	double start = now_ns();
+	int round;
+
+	for ( round = 0; round < ROUNDS; round++ ) {
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+	}
+
+	pthread_barrier_wait(&barrier);
+
+	double elapsed = now_ns() - start;
+	size_t remote = 0, counted = 0;
+
+	for ( i = 0; i < number_of_threads; i++ ) {
+		pthread_join(workers[i].thread, NULL);
+		remote += workers[i].remote;
+		counted += workers[i].counted;
+	}
+
+	printf("threads %d nodes %d%s\n", number_of_threads, number_of_nodes, simulated ? " (simulated)" : "");
+	printf("ns/op              %12.1f\n", elapsed / ((double) number_of_threads * ROUNDS * BATCH));
+	printf("remote blocks      %12.3f\n", counted > 0 ? (double) remote / counted : 0.0);
+
+	return 0;
+}
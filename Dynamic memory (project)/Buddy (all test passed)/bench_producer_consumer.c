@@ -0,0 +1,131 @@
+/*
+* Measures the throughput of pipelines where one thread allocates
+* records and another frees them, as when the records of a program
+* like gawk are built by one thread and dropped by another.
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -o bench_producer_consumer bench_producer_consumer.c our_malloc.c ../page_source.c -lpthread
+*	./bench_producer_consumer [pairs]
+*
+* Every pair has a producer that allocates records of mostly small
+* sizes and passes them through a ring to its consumer, which frees
+* them. All the frees are of blocks another thread allocated: without
+* a way back to the producer they go through the shared free lists.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "our_malloc.h"
+
+#define RECORDS			4000000
+#define RING_SIZE		256	// a power of two
+#define MAXIMUM_PAIRS		32
+
+// Sizes of the records, the small ones as often as in the gawk traces
+static const size_t request_sizes[] = { 32, 32, 48, 48, 48, 64, 64, 96, 160, 256, 400, 700 };
+
+#define NUMBER_OF_SIZES		(sizeof(request_sizes) / sizeof(request_sizes[0]))
+
+/*
+* A ring with one writer and one reader. Each index is only written
+* by its own side.
+*/
+typedef struct pipeline {
+	char * records[RING_SIZE];
+	size_t head __attribute__ ((aligned (64))); // next to write
+	size_t tail __attribute__ ((aligned (64))); // next to read
+	pthread_t producer;
+	pthread_t consumer;
+	size_t checksum;
+} pipeline;
+
+static pipeline pipelines[MAXIMUM_PAIRS];
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void * produce(void * data)
+{
+	pipeline * pipe = data;
+	unsigned int seed = pipe - pipelines;
+	size_t i;
+
+	for ( i = 0; i < RECORDS; i++ ) {
+		size_t size = request_sizes[rand_r(&seed) % NUMBER_OF_SIZES];
+		char * record = malloc(size);
+
+		record[0] = (char) i;
+		record[size - 1] = (char) i;
+
+		while ( i - __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE) >= RING_SIZE )
+			sched_yield();
+
+		pipe->records[i % RING_SIZE] = record;
+		__atomic_store_n(&pipe->head, i + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+static void * consume(void * data)
+{
+	pipeline * pipe = data;
+	size_t i;
+
+	for ( i = 0; i < RECORDS; i++ ) {
+		while ( __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE) == i )
+			sched_yield();
+
+		char * record = pipe->records[i % RING_SIZE];
+
+		pipe->checksum += (unsigned char) record[0];
+		free(record);
+
+		__atomic_store_n(&pipe->tail, i + 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+	int pairs = argc > 1 ? atoi(argv[1]) : 1;
+	int i;
+
+	if ( pairs < 1 || pairs > MAXIMUM_PAIRS ) {
+		fprintf(stderr, "usage: %s [pairs] (1 to %d)\n", argv[0], MAXIMUM_PAIRS);
+		return 1;
+	}
+
+	double start = now_ns();
+
+	for ( i = 0; i < pairs; i++ ) {
+		pthread_create(&pipelines[i].consumer, NULL, consume, &pipelines[i]);
+		pthread_create(&pipelines[i].producer, NULL, produce, &pipelines[i]);
+	}
+
+	for ( i = 0; i < pairs; i++ ) {
+		pthread_join(pipelines[i].producer, NULL);
+		pthread_join(pipelines[i].consumer, NULL);
+	}
+
+	double elapsed = now_ns() - start;
+	double records = (double) pairs * RECORDS;
+
+	printf("pairs %d\n", pairs);
+	printf("ns/record          %12.1f\n", elapsed / records);
+	printf("records/s          %12.0f\n", records / elapsed * 1e9);
+
+	fflush(stdout);
+	malloc_print_statistics(1);
+
+	return 0;
+}
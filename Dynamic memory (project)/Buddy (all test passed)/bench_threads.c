@@ -0,0 +1,85 @@
+/*
+* Measures malloc/free throughput as the number of threads
+* grows from 1 to the number of cores (or argv[1]).
+*
+* Build together with the allocator:
+*	cc -O2 -fno-builtin -pthread -o bench_threads bench_threads.c our_malloc.c ../page_source.c
+*
+* Every thread keeps a window of live blocks of random small
+* sizes and replaces one of them at a time.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "our_malloc.h"
+
+#define OPERATIONS_PER_THREAD	2000000
+#define WINDOW			256
+#define MAXIMUM_REQUEST_SIZE	512
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void * worker(void * arg)
+{
+	void * window[WINDOW];
+	unsigned int seed = (unsigned int) (size_t) arg;
+	size_t i;
+
+	memset(window, 0, sizeof(window));
+
+	for ( i = 0; i < OPERATIONS_PER_THREAD; i++ ) {
+		size_t slot = rand_r(&seed) % WINDOW;
+
+		free(window[slot]);
+		window[slot] = malloc(1 + rand_r(&seed) % MAXIMUM_REQUEST_SIZE);
+		*(char*) window[slot] = 1;
+	}
+
+	for ( i = 0; i < WINDOW; i++ )
+		free(window[i]);
+
+	return NULL;
+}
+
+int main(int argc, char * argv[])
+{
+	long maximum_threads = argc > 1 ? atol(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t * threads = malloc(maximum_threads * sizeof(pthread_t));
+	long n;
+
+	printf("%8s %16s %10s\n", "threads", "Mops/s", "speedup");
+
+	double single = 0;
+
+	for ( n = 1; n <= maximum_threads; n++ ) {
+		long t;
+		double start = now_ns();
+
+		for ( t = 0; t < n; t++ )
+			pthread_create(&threads[t], NULL, worker, (void*) (size_t) (t + 1));
+
+		for ( t = 0; t < n; t++ )
+			pthread_join(threads[t], NULL);
+
+		double elapsed = now_ns() - start;
+		// Every iteration is one malloc and one free
+		double mops = 2.0 * n * OPERATIONS_PER_THREAD / elapsed * 1e3;
+
+		if ( n == 1 )
+			single = mops;
+
+		printf("%8ld %16.2f %10.2f\n", n, mops, mops / single);
+	}
+
+	free(threads);
+	return 0;
+}
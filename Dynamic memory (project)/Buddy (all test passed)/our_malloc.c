@@ -9,8 +9,19 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
 
 #include "our_malloc.h"
+#include "../page_source.h"
 
 //#define DEBUG_ALIGNMENT_OUR_MALLOC
 //#define DEBUG_OUR_MALLOC
@@ -18,313 +29,2815 @@
 
 //#define WRITE_LIFTED
 
-#define ALIGNMENT_SIZE_FOR_MALLOC	8
+#define ALIGNMENT_SIZE_FOR_MALLOC	16
+
+// Alignment of the objects of the slab classes that are multiples of it
+#define CACHELINE_SIZE			64
+
+/*
+* The geometry of the heap: arenas of 2^UPPER_LIMIT_ORDER bytes split
+* down to blocks of 2^MINIMUM_BLOCK_ORDER bytes. Both can be given
+* when compiling, e.g. -DMINIMUM_BLOCK_ORDER=6 for 64 byte blocks or
+* -DMINIMUM_BLOCK_ORDER=12 for 4 KB ones. Everything else, the tables
+* included, follows from them.
+*/
+#ifndef UPPER_LIMIT_ORDER
+#define UPPER_LIMIT_ORDER		23	// 8 MB arenas
+#endif
 
-#define UPPER_LIMIT_ORDER		23
+#ifndef MINIMUM_BLOCK_ORDER
+#define MINIMUM_BLOCK_ORDER		8	// 256 byte blocks
+#endif
 
-#define NUMBER_OF_LEVELS		22
+#define NUMBER_OF_LEVELS		(UPPER_LIMIT_ORDER - MINIMUM_BLOCK_ORDER + 1)
 
-#define MINIMUM_BLOCK_SIZE		(1<<(UPPER_LIMIT_ORDER - NUMBER_OF_LEVELS + 1))
+#define MINIMUM_BLOCK_SIZE		(1<<(MINIMUM_BLOCK_ORDER))
 #define MAXIMUM_BLOCK_SIZE		(1<<(UPPER_LIMIT_ORDER))
 
+#define BLOCK_SIZE_OF_ORDER(order)	((size_t) MINIMUM_BLOCK_SIZE << (order))
+
+// The lowest order whose blocks hold at least 2^log2 bytes
+#define ORDER_OF_AT_LEAST(log2)		((log2) > MINIMUM_BLOCK_ORDER ? (log2) - MINIMUM_BLOCK_ORDER : 0)
+
+/*
+* Blocks carry no header. This is stored in the payload
+* of free blocks only, allocated blocks are all payload.
+*/
 typedef struct meta_info {
-	// This is stored on each block
-	size_t order;
-	// free is used to check if this
-	// is a left or right buddy and if it
-	// is allocated or not.
-	int free; 
 	struct meta_info * succ; // successor in ths free list this block belongs to
 	struct meta_info * pred; // predecessor in ths free list this block belongs to
 } meta_info;
 
+/*
+* Every arena, and every chunk too large for one, is a region
+* that starts at a multiple of MAXIMUM_BLOCK_SIZE with this header.
+* An arena keeps the order and state of its blocks in a table right
+* after the header, one byte per MINIMUM_BLOCK_SIZE of the arena.
+* The table sits in the first block of the arena, which is never
+* handed out.
+*/
+typedef struct region {
+	size_t kind;
+	size_t length; // number of bytes mapped, 0 for an arena on the break
+	uint32_t blocks_in_use; // taken from the free lists, deferred ones included
+	uint32_t blocks_deferred;
+	uint32_t node; // whose free lists the blocks of an arena go to
+	void * remote_frees; // see REMOTE_CAPACITY
+	struct region * next_remote; // in the list of its node while it has remote frees
+	unsigned char blocks[];
+} region;
+
+#define ARENA_REGION			1
+#define LARGE_CHUNK_REGION		2
+
+// The payload of a large chunk starts this far into the region
+#define LARGE_CHUNK_HEADER		64
+
+#define NUMBER_OF_BLOCK_ENTRIES		(MAXIMUM_BLOCK_SIZE >> MINIMUM_BLOCK_ORDER)
+
+/*
+* A byte of the block table holds the order of the block starting
+* there, and whether it is free or part of a slab page. A free block
+* marked BLOCK_ZEROED has not been written since the system gave
+* it, but for the free list links in its first bytes. An allocated
+* block marked BLOCK_CONTINUED (the same bit) is followed by another
+* block of the same allocation, see EXTENT_MINIMUM.
+*/
+#define BLOCK_ORDER_MASK		0x1f
+#define BLOCK_ZEROED			0x20
+#define BLOCK_CONTINUED			0x20
+#define BLOCK_SLAB			0x40
+#define BLOCK_FREE			0x80
+
+#if NUMBER_OF_LEVELS < 2 || NUMBER_OF_LEVELS > BLOCK_ORDER_MASK + 1
+#error "the orders do not fit the block table"
+#endif
+
+#if MINIMUM_BLOCK_ORDER < 5 || UPPER_LIMIT_ORDER > 30
+#error "MINIMUM_BLOCK_ORDER must be at least 5 and UPPER_LIMIT_ORDER at most 30"
+#endif
+
+/*
+* A request of more than EXTENT_MINIMUM bytes is rounded up to whole
+* blocks of EXTENT_PIECE_ORDER, not to a power of two. It takes a block
+* of the order above and gives back the tail it does not need, keeping
+* a run of blocks of falling orders: an extent. Rounding up to a power
+* of two would waste up to half of the block.
+*/
+#define EXTENT_MINIMUM			(64 << 10)
+#define EXTENT_PIECE_ORDER		ORDER_OF_AT_LEAST(12)	// 4 KB
+
+// Arenas for up to 8 GB, whatever their size
+#define MAXIMUM_NUMBER_OF_ARENAS	(((size_t) 8 << 30) >> UPPER_LIMIT_ORDER)
+
+/*
+* A free block of at least trim_threshold bytes gives its pages back
+* to the system, all but the first which holds the free list links.
+* An arena that is entirely free is unmapped, or cut off the break if
+* it is the uppermost, unless it is the only one of its node. The
+* threshold is set with OUR_MALLOC_TRIM_THRESHOLD, to a page or more,
+* and 0 turns trimming off.
+*/
+#define DEFAULT_TRIM_THRESHOLD		(1 << 20)
+#define TRIM_PAGE_SIZE			4096
+
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
+
+/*
+* Every NUMA node has arenas of its own, with their memory bound to
+* the node, and free lists of its own. A thread takes blocks from the
+* lists of the node it ran on when it first called the allocator, and
+* a block freed by a thread of another node goes back to the lists of
+* its arena rather than to the cache of that thread.
+*
+* The nodes are counted in /sys/devices/system/node/online. With
+* OUR_MALLOC_NODES=<n> there are n nodes instead, and the threads are
+* dealt to them in turn, which simulates a topology on a machine that
+* has fewer. OUR_MALLOC_NODES=1 puts everything on one node.
+*/
+#define MAXIMUM_NUMBER_OF_NODES		8
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED			1
+#endif
+
+static size_t number_of_nodes = 1;
+static int simulated_nodes = 0;
+
 /*
 * Here is the free lists stored in the data segment on the program. 
+* They are shared by all arenas of a node.
+*/
+static meta_info* free_lists[MAXIMUM_NUMBER_OF_NODES][NUMBER_OF_LEVELS];
+
+/*
+* Every arena is one block of the highest order, placed at an address
+* that is a multiple of MAXIMUM_BLOCK_SIZE. The top of the heap an
+* arena starts at is thus found by masking any address inside it.
 */
-static meta_info* free_lists[NUMBER_OF_LEVELS];
+static void * arenas[MAXIMUM_NUMBER_OF_ARENAS];
+static size_t number_of_arenas = 0;
 
-static void * top_of_the_heap = NULL;
+/*
+* Protects the free lists and the arenas.
+*/
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
 
-#ifdef WRITE_LIFTED
-void * start;
+/*
+* Each thread keeps recently freed blocks of the small orders
+* to itself, linked through their first word, so most calls to
+* malloc and free never touch the shared free lists. The cache is
+* refilled from and drained to the buddy system TCACHE_BATCH blocks
+* at a time.
+*/
+#define TCACHE_ORDERS			(ORDER_OF_AT_LEAST(10) + 1)	// blocks of up to 1 KB
+#define TCACHE_CAPACITY			64
+#define TCACHE_BATCH			32
+
+/*
+* Freed blocks of the orders from TCACHE_ORDERS up to DEFERRED_ORDERS
+* are not merged with their buddies right away. They stay marked
+* allocated in the block table and wait in a list per order for the
+* next request of that order, so a size that is freed and asked for
+* again is not merged up and split down each time. A list that grows
+* past DEFERRED_CAPACITY merges DEFERRED_BATCH of its blocks. All
+* are merged before the heap is grown for want of a larger block, and
+* those of an arena when they are all that is left in use there.
+* Protected by the heap lock.
+*/
+#define DEFERRED_ORDERS			(ORDER_OF_AT_LEAST(16) + 1)	// blocks of up to 64 KB
+#define DEFERRED_CAPACITY		16
+#define DEFERRED_BATCH			8
+
+#if DEFERRED_ORDERS >= NUMBER_OF_LEVELS
+#error "arenas too small for the deferred orders"
 #endif
 
+static void * deferred_blocks[MAXIMUM_NUMBER_OF_NODES][DEFERRED_ORDERS];
+static size_t deferred_count[MAXIMUM_NUMBER_OF_NODES][DEFERRED_ORDERS];
+
 /*
-* Initialize the free_lists
+* A thread cache that overflows, and a free of a block of another
+* node, hand the blocks to their arena rather than take a lock. Every
+* arena has a stack of remote frees that any thread pushes to with a
+* compare and swap, and the push that finds it empty puts the arena on
+* a stack of its node the same way. The next thread of the node whose
+* cache runs empty takes both stacks whole, again with a compare and
+* swap, and keeps what is on them. A thread that frees what another
+* one allocates thus returns the blocks without the heap lock or the
+* lock of a slab class. A node holds up to REMOTE_CAPACITY of them,
+* past that the caches drain under the locks. When the last thread of
+* a node exits it takes what is left, and what is pushed for a node
+* with no threads goes back under the locks with the next free that
+* takes the heap lock.
 */
-static void buddy_system_init()
-{
-	// Align the base of the heap
-	top_of_the_heap = sbrk(0);
+#define REMOTE_CAPACITY			256
 
-	intptr_t offset = ((intptr_t) top_of_the_heap) % ALIGNMENT_SIZE_FOR_MALLOC;
+static region * remote_arenas[MAXIMUM_NUMBER_OF_NODES];
+static size_t remote_count[MAXIMUM_NUMBER_OF_NODES];
 
-	if ( offset != 0 ) {
-		//printf("offset not zero.\n");
-		void * status = sbrk(ALIGNMENT_SIZE_FOR_MALLOC - offset);
-		assert ( status != (void*) - 1);
+// Registered threads of each node, protected by the heap lock
+static size_t threads_on_node[MAXIMUM_NUMBER_OF_NODES];
+
+/*
+* Requests of up to MAXIMUM_SLAB_SIZE bytes are served from slab pages:
+* buddy blocks of SLAB_PAGE_ORDER cut into objects of one size class,
+* with the pages of each node in lists of their own.
+* Every entry of the block table that covers a slab page is marked
+* BLOCK_SLAB, and the page it sits in is found by masking the
+* address of an object.
+*/
+#define SLAB_PAGE_ORDER			ORDER_OF_AT_LEAST(12)	// 4 KB pages
+#define SLAB_PAGE_SIZE			BLOCK_SIZE_OF_ORDER(SLAB_PAGE_ORDER)
+#define MAXIMUM_SLAB_SIZE		256
+#define NUMBER_OF_SLAB_CLASSES		8
+
+static const size_t slab_sizes[NUMBER_OF_SLAB_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256 };
+
+// The size class for a request, indexed by the size in units of 16 bytes (rounded up)
+static const unsigned char slab_class_of[MAXIMUM_SLAB_SIZE / 16 + 1] = { 0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7 };
+
+typedef struct slab_page {
+	size_t size_class;
+	size_t node; // in whose lists the page is
+	size_t in_use; // number of objects handed out
+	void * free_objects; // linked through the first word of each object
+	struct slab_page * next; // in the list of pages of this class with free objects
+	struct slab_page * prev;
+} slab_page;
+
+#define SLAB_FIRST_OBJECT		((sizeof(slab_page) + CACHELINE_SIZE - 1) & ~(size_t) (CACHELINE_SIZE - 1))
+
+typedef struct slab_class {
+	pthread_mutex_t lock;
+	slab_page * partial;
+} slab_class;
+
+static slab_class slab_classes[MAXIMUM_NUMBER_OF_NODES][NUMBER_OF_SLAB_CLASSES] = {
+	[0 ... MAXIMUM_NUMBER_OF_NODES - 1] = {
+		[0 ... NUMBER_OF_SLAB_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL }
 	}
+};
+
+#define NUMBER_OF_CALLS			MALLOC_NUMBER_OF_CALLS
+
+typedef struct thread_cache {
+	void * blocks[TCACHE_ORDERS];
+	size_t count[TCACHE_ORDERS];
+	void * objects[NUMBER_OF_SLAB_CLASSES];
+	size_t object_count[NUMBER_OF_SLAB_CLASSES];
+	int registered;
+	uint32_t number; // of the thread, in the trace
+	uint32_t node;
+	size_t calls[NUMBER_OF_CALLS];
+	size_t requests[MALLOC_REQUEST_HISTOGRAM_SIZE];
+	struct thread_cache * next; // in the list of registered caches
+	struct thread_cache * prev;
+} thread_cache;
+
+static __thread thread_cache this_thread_cache;
+
+static pthread_key_t thread_cache_key;
+static pthread_once_t initialize_once = PTHREAD_ONCE_INIT;
+
+// Number of calls to realloc that did not have to copy
+static size_t reallocs_in_place = 0;
+
+/*
+* Statistics. Every thread counts its calls in its own cache, the
+* counts are added to the exited_* totals when the thread exits.
+* The rest is protected by the heap lock.
+*/
+static size_t heap_size = 0;
+static size_t peak_heap_size = 0;
+static size_t splits = 0;
+static size_t merges = 0;
+static size_t exited_calls[NUMBER_OF_CALLS];
+static size_t exited_requests[MALLOC_REQUEST_HISTOGRAM_SIZE];
+static thread_cache * thread_caches = NULL;
+static uint32_t number_of_threads = 0;
+
+/*
+* The trace is written in batches of TRACE_BUFFER_RECORDS,
+* and at exit.
+*/
+#define TRACE_BUFFER_RECORDS		256
+
+static int trace_fd = -1;
+static int print_statistics_at_exit = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static malloc_trace_record trace_buffer[TRACE_BUFFER_RECORDS];
+static size_t trace_length = 0;
+
+/*
+* Maps of the heap, see malloc_dump_heap(). SIGUSR2 only raises
+* heap_map_requested, the map is written by the next call, which can
+* take the heap lock.
+*/
+#define HEAP_MAP_BUFFER_RECORDS		256
 
-	// Allocating the heap that is going to be used.
-	// We are allocating a suffieciently large block at once only
-	// in the buddy system.
-	top_of_the_heap = sbrk( MAXIMUM_BLOCK_SIZE );
-	assert ( top_of_the_heap != (void*) - 1);
+static int heap_map_fd = -1;
+static volatile sig_atomic_t heap_map_requested = 0;
+
+/*
+* Checks against heap corruption, on when OUR_MALLOC_CHECK is set.
+* Every block then ends in a canary word: a secret mixed with the
+* address of the block and its size as the region and the block table
+* tell it. A write past the payload or over the table entry shows when
+* the block is freed, as does a pointer that is not a block. Freeing
+* inverts the canary, and a block must not be marked free already, so
+* a second free is caught.
+*
+* OUR_MALLOC_QUARANTINE=<bytes> keeps up to that many bytes of freed
+* blocks from being used again. They are filled with QUARANTINE_POISON,
+* which must be intact when they leave the quarantine, oldest first.
+* OUR_MALLOC_VALIDATE=<n> runs malloc_check_heap() every n calls.
+* Both turn the checks on as well. What is found is written to stderr
+* and the program aborted.
+*/
+#define QUARANTINE_POISON		0xfd
+#define QUARANTINE_SLOTS		1024
+
+static int checking = 0;
+static size_t canary_size = 0; // sizeof(uintptr_t) when checking
+static uintptr_t canary_secret;
+static size_t validate_interval = 0;
+static size_t calls_since_validation = 0;
+
+/*
+* A ring, oldest at quarantine_head. Protected by the quarantine
+* lock, which is never taken with another lock held.
+*/
+static void * quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_head = 0;
+static size_t quarantine_length = 0;
+static size_t quarantine_bytes = 0;
+static size_t quarantine_limit = 0;
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void * allocate(size_t);
+static void * block_allocate(size_t);
+static void * zeroed_allocate(size_t);
+static void release(void *);
+static void record_call(uint32_t, void *, size_t, void *);
+static void print_line(int, const char *, ...);
+
+#define TOP_OF_THE_HEAP(ptr)		((uintptr_t) (ptr) & ~((uintptr_t) MAXIMUM_BLOCK_SIZE - 1))
 
 #ifdef WRITE_LIFTED
-	start = top_of_the_heap;
-#endif 
+void * start;
+#endif
 
-	// The heap is allocated!
-	meta_info * first_node = (meta_info*) top_of_the_heap;
-	first_node->order = NUMBER_OF_LEVELS - 1;
-	first_node->free = 1;
-	first_node->succ = NULL;
-	first_node->pred = NULL;
+#define BLOCK_SIZES_OF_4_ORDERS(order)	BLOCK_SIZE_OF_ORDER(order), BLOCK_SIZE_OF_ORDER(order + 1), BLOCK_SIZE_OF_ORDER(order + 2), BLOCK_SIZE_OF_ORDER(order + 3)
 
-	// Initialize the free list
-	free_lists[first_node->order] = first_node;
-}
+/*
+* The size of a block of each order. It is also the bit of the
+* offset into the arena that tells a block from its buddy. The table
+* has an entry for every order the block table can hold, those from
+* NUMBER_OF_LEVELS up are never used.
+*/
+static const size_t block_sizes[BLOCK_ORDER_MASK + 1] = {
+	BLOCK_SIZES_OF_4_ORDERS(0), BLOCK_SIZES_OF_4_ORDERS(4), BLOCK_SIZES_OF_4_ORDERS(8), BLOCK_SIZES_OF_4_ORDERS(12),
+	BLOCK_SIZES_OF_4_ORDERS(16), BLOCK_SIZES_OF_4_ORDERS(20), BLOCK_SIZES_OF_4_ORDERS(24), BLOCK_SIZES_OF_4_ORDERS(28)
+};
+
+// Orders of the requests up to SMALL_ORDER_LIMIT, indexed by the size in blocks of order 0 (rounded up)
+#define SMALL_ORDER_LIMIT		(MINIMUM_BLOCK_SIZE * 16)
+
+static const unsigned char small_orders[SMALL_ORDER_LIMIT / MINIMUM_BLOCK_SIZE + 1] = { 0, 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
 
 /*
 * This function maps a gien size (requested)
 * to an order that can be mapped tp the free_lists vector
 *
 * Examples: 
-*		If we have the lowest level 0 mapped to 2^12
-*		then all number <= 2^12 will be mapped to 0
-*		and all numbers >= 2^13 will be mapped to a value > 0
+*		If we have the lowest level 0 mapped to 2^8
+*		then all number <= 2^8 will be mapped to 0
+*		and all numbers >= 2^8 + 1 will be mapped to a value > 0
+*
+* Common sizes are looked up in a table, the rest take the
+* number of significant bits of size - 1.
 */
 static size_t map_size_to_order(size_t size)
 {
-	if ( size < MINIMUM_BLOCK_SIZE ) {
-		return 0;
-	} else {
-		size_t count = 0;
-		size -= 1;
-		while ( size >= MINIMUM_BLOCK_SIZE ) {
-			count++;
-			size >>= 1;
-		}
-		return count;
-	}
+	if ( size <= SMALL_ORDER_LIMIT )
+		return small_orders[(size + MINIMUM_BLOCK_SIZE - 1) >> MINIMUM_BLOCK_ORDER];
+
+	return sizeof(unsigned long) * 8 - __builtin_clzl(size - 1) - MINIMUM_BLOCK_ORDER;
+}
+
+static region * region_of(void * ptr)
+{
+	return (region*) TOP_OF_THE_HEAP(ptr);
+}
+
+/*
+* Returns the entry of the block table for the block starting at 'block'.
+*/
+static unsigned char * block_state(void * block)
+{
+	region * arena = region_of(block);
+	return &arena->blocks[((uintptr_t) block - (uintptr_t) arena) >> MINIMUM_BLOCK_ORDER];
+}
+
+/*
+* The node whose free lists hold the block. With one node the arena
+* header is not read.
+*/
+static size_t node_of_block(void * block)
+{
+	return number_of_nodes > 1 ? region_of(block)->node : 0;
 }
 
-static meta_info * find_buddy(meta_info * ptr) 
+static void * find_buddy(void * ptr, size_t order) 
 {
 	if ( ptr == NULL )
 		return NULL;
 
-	uintptr_t address_to_buddy = (uintptr_t) top_of_the_heap + (((uintptr_t) ptr - (uintptr_t) top_of_the_heap) ^ (1 << ((UPPER_LIMIT_ORDER - NUMBER_OF_LEVELS + 1) + ptr->order)));
+	uintptr_t top_of_the_heap = TOP_OF_THE_HEAP(ptr);
+	uintptr_t address_to_buddy = top_of_the_heap + (((uintptr_t) ptr - top_of_the_heap) ^ block_sizes[order]);
 	return (void*) address_to_buddy;
 }
 
-static size_t align_this_size(size_t size) {
-	return ( size + ALIGNMENT_SIZE_FOR_MALLOC - 1 ) & ~(ALIGNMENT_SIZE_FOR_MALLOC - 1);
+/*
+* Puts a block in the free list of its order, of the node of its arena.
+* 'zeroed' is BLOCK_ZEROED if the block is known to hold only zeroes.
+*/
+static void add_to_free_list(void * ptr, size_t order, unsigned char zeroed)
+{
+	meta_info * block = ptr;
+	meta_info ** list = &free_lists[node_of_block(block)][order];
+
+	*block_state(block) = order | BLOCK_FREE | zeroed;
+
+	block->pred = NULL;
+	block->succ = *list;
+
+	if ( *list != NULL )
+		(*list)->pred = block;
+
+	*list = block;
 }
 
-static void add_to_free_list(meta_info * block)
+/*
+* Unlinks a block from the free list of the given order and
+* marks it allocated. The block carries its own pred/succ
+* links, so no walk of the list is needed.
+*/
+static void remove_from_free_list(void * ptr, size_t order)
 {
-	size_t order = block->order;
-	block->pred = NULL;
-	block->succ = free_lists[order];
+	meta_info * block = ptr;
+	meta_info * last = block->pred;
+	meta_info * next = block->succ;
 
-	if ( free_lists[order] != NULL )
-		free_lists[order]->pred = block;
+	if ( last != NULL )
+		last->succ = next;
+	else
+		free_lists[node_of_block(block)][order] = next;
 
-	free_lists[order] = block;
+	if ( next != NULL )
+		next->pred = last;
+
+	*block_state(block) = order;
 }
 
-static void remove_from_free_list(meta_info * block, size_t order)
+// Whether the block at 'block' is free as a whole and of the given order
+static int is_free_block(void * block, size_t order)
 {
-	meta_info * walk;
-	walk = free_lists[order];
+	return (*block_state(block) & ~BLOCK_ZEROED) == (order | BLOCK_FREE);
+}
 
-	while ( walk != NULL ) {
+/*
+* Maps len bytes with the start aligned to 'alignment'
+* (a power of two, at least the page size).
+*/
+static void * map_aligned(size_t len, size_t alignment)
+{
+	char * region = mmap(NULL, len + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
 
-		if ( walk == block ) {
-			// this one should be removed
-			meta_info * last = walk->pred;
-			meta_info * next = walk->succ;
+	if ( region == MAP_FAILED )
+		return NULL;
 
-			if ( last != NULL )
-				last->succ = next;
+	uintptr_t offset = (uintptr_t) region & (alignment - 1);
+	size_t head = offset == 0 ? 0 : alignment - offset;
 
-			if ( next != NULL )
-				next->pred = last;
+	// Give back what is outside of the aligned range
+	if ( head > 0 )
+		munmap(region, head);
+	munmap(region + head + len, alignment - head);
 
-			if ( walk == free_lists[order] )
-				free_lists[order] = next;
+	return region + head;
+}
 
-			walk->free = 0;
-		}
+// The order of the first block of an arena, which holds the block table
+static size_t table_block_order()
+{
+	return map_size_to_order(sizeof(region) + NUMBER_OF_BLOCK_ENTRIES);
+}
 
-		walk = walk->succ;
-	}	
+/*
+* Accounts for 'length' more bytes taken from the system.
+* The heap lock must be held.
+*/
+static void count_heap_growth(size_t length)
+{
+	heap_size += length;
+
+	if ( heap_size > peak_heap_size )
+		peak_heap_size = heap_size;
 }
 
-void * calloc(size_t count, size_t size)
+/*
+* Asks for the pages of an arena to be placed on its node where the
+* system allows, before any of them is written: they are placed when
+* first written. A simulated node may not exist, its arenas then go
+* where first touched.
+*/
+static void bind_to_node(void * start, size_t length, size_t node)
 {
+#ifdef SYS_mbind
+	unsigned long mask = 1UL << node;
 
-#ifdef WRITE_LIFTED
-	setvbuf(stderr, NULL, _IONBF, 0);
-	fprintf(stderr, "lifted (so far): %d\n", sbrk(0) - start);
+	if ( number_of_nodes > 1 )
+		syscall(SYS_mbind, start, length, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
 #endif
+}
 
-#ifdef DEBUG_OUR_MALLOC
-	//printf("CALLOC CALLED\n");
-#endif
+/*
+* Grows the heap by one arena of the given node and puts it in the
+* free lists. Returns 0 if no memory could be had.
+*/
+static int add_arena(size_t node)
+{
+	if ( number_of_arenas == MAXIMUM_NUMBER_OF_ARENAS )
+		return 0;
 
-	size_t total = count * size;
-	size_t actual = align_this_size(total);
-	void * request = malloc(actual);
+	// Align the arena to its own size by padding the break
+	char * top_of_the_heap = page_source_extend(0);
+	intptr_t offset = ((intptr_t) top_of_the_heap) % MAXIMUM_BLOCK_SIZE;
+	intptr_t padding = offset == 0 ? 0 : MAXIMUM_BLOCK_SIZE - offset;
 
-	if ( request == NULL )
-		return NULL;
+	top_of_the_heap = page_source_extend(padding + MAXIMUM_BLOCK_SIZE);
+	size_t mapped = 0;
 
-	memset(request, 0, actual);
-	return request;
-}
+	if ( top_of_the_heap != (void*) - 1 ) {
+		top_of_the_heap += padding;
+	} else {
+		// The page source could not be extended, take the arena from an anonymous mapping instead.
+		top_of_the_heap = map_aligned(MAXIMUM_BLOCK_SIZE, MAXIMUM_BLOCK_SIZE);
+		mapped = MAXIMUM_BLOCK_SIZE;
 
-void * realloc(void* ptr, size_t size) {
+		if ( top_of_the_heap == NULL )
+			return 0;
+	}
 
-	if ( ptr == NULL ) {
-		// realloc(NULL, size) should be identical to malloc(size)
-		return malloc(size);
-	} else if ( size == 0 ) {
-		// If size is zero and ptr is not NULL, a new, minimum sized object is
-    	// allocated and the original object is freed.
-		free(ptr);
-		return malloc(10); // lets say 10 is our minimum size object.
+#ifdef WRITE_LIFTED
+	if ( number_of_arenas == 0 )
+		start = top_of_the_heap;
+#endif 
+
+	arenas[number_of_arenas++] = top_of_the_heap;
+	count_heap_growth(MAXIMUM_BLOCK_SIZE);
+
+	bind_to_node(top_of_the_heap, MAXIMUM_BLOCK_SIZE, node);
+
+	region * arena = (region*) top_of_the_heap;
+	arena->kind = ARENA_REGION;
+	arena->length = mapped;
+	arena->blocks_in_use = 0;
+	arena->blocks_deferred = 0;
+	arena->node = node;
+	arena->remote_frees = NULL;
+	arena->next_remote = NULL;
+
+	// Split the arena down to the block that holds the table, every
+	// upper half goes to the free lists. The pages are new, the
+	// system has cleared them.
+	size_t order = NUMBER_OF_LEVELS - 1;
+	size_t table_order = table_block_order();
+
+	while ( order > table_order ) {
+		order--;
+		add_to_free_list(top_of_the_heap + block_sizes[order], order, BLOCK_ZEROED);
 	}
-	void * tmp = malloc(size);
-	size_t old_size = (1 << ( (UPPER_LIMIT_ORDER - NUMBER_OF_LEVELS + 1) + ((meta_info*)(ptr-sizeof(meta_info)))->order) );  
 
-	if ( tmp != ptr )
-		memcpy(tmp, ptr, old_size < size ? old_size : size );
-	free(ptr);
+	arena->blocks[0] = table_order;
 
-	return tmp;
+	return 1;
 }
 
-void * malloc(size_t requested_size)
+/*
+* Serves a request too large for an arena with a mapping of its own.
+* The payload starts 'offset' bytes into the region, which is aligned
+* to MAXIMUM_BLOCK_SIZE, so it is aligned to 'offset' as well.
+*/
+static void * large_chunk_malloc(size_t size, size_t offset)
 {
-	size_t size = align_this_size(requested_size) + sizeof(meta_info);
+	size_t length = size + offset;
 
-	if ( size >= MAXIMUM_BLOCK_SIZE ) {
+	if ( length < size ) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
-	if ( top_of_the_heap == NULL ) {
-		// Top of the heap is set
-		// And the free_lists is initialized
-		// with one huge block of memory
-		buddy_system_init();
+	region * chunk = map_aligned(length, MAXIMUM_BLOCK_SIZE);
+
+	if ( chunk == NULL ) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	size_t order = map_size_to_order(size);
+	chunk->kind = LARGE_CHUNK_REGION;
+	chunk->length = length;
+
+	pthread_mutex_lock(&heap_lock);
+	count_heap_growth(length);
+	pthread_mutex_unlock(&heap_lock);
+
+	return (void*)chunk + offset;
+}
+
+/*
+* Returns the slab page ptr belongs to, or NULL if ptr is
+* not a slab object. ptr must not be in a large chunk.
+*/
+static slab_page * slab_page_of(void * ptr)
+{
+	if ( *block_state(ptr) & BLOCK_SLAB )
+		return (slab_page*) ((uintptr_t) ptr & ~(SLAB_PAGE_SIZE - 1));
+
+	return NULL;
+}
+
+/*
+* Returns the number of bytes that can be stored in the
+* block pointed to by ptr.
+*/
+static size_t payload_size(void * ptr)
+{
+	region * r = region_of(ptr);
+
+	if ( r->kind == LARGE_CHUNK_REGION )
+		return r->length - ((uintptr_t) ptr - (uintptr_t) r);
+
+	slab_page * page = slab_page_of(ptr);
+
+	if ( page != NULL )
+		return slab_sizes[page->size_class];
+
+	// All the blocks of an extent
+	size_t size = 0;
+	unsigned char state;
+
+	do {
+		state = *block_state(ptr + size);
+		size += block_sizes[state & BLOCK_ORDER_MASK];
+	} while ( state & BLOCK_CONTINUED );
+
+	return size;
+}
+
+/*
+* Tries to make the block at ptr fit 'size' bytes without moving it.
+* A block shrinks by handing its upper halves back to the free lists,
+* and grows by absorbing its buddies as long as it is the lower one
+* of each pair and the buddy is free as a whole. Returns 1 on success.
+*/
+static int resize_in_place(void * ptr, size_t requested_size)
+{
+	// A block never changes kind, nor a slab object its class, so
+	// that the size given to free_sized() tells where it came from.
+	if ( region_of(ptr)->kind == LARGE_CHUNK_REGION )
+		return requested_size > MAXIMUM_BLOCK_SIZE / 2 && requested_size <= payload_size(ptr);
+
+	slab_page * page = slab_page_of(ptr);
 
-	meta_info * aspirant = free_lists[order];
+	if ( page != NULL )
+		return requested_size <= MAXIMUM_SLAB_SIZE && slab_class_of[(requested_size + 15) / 16] == page->size_class;
 
-	if ( aspirant == NULL ){
-		// There is no block of a suitable size available.
+	if ( *block_state(ptr) & BLOCK_CONTINUED )
+		return requested_size > EXTENT_MINIMUM && requested_size <= payload_size(ptr);
 
-		// We have to create one.
-		size_t next_available_order = order + 1;
+	if ( requested_size <= MAXIMUM_SLAB_SIZE || requested_size > MAXIMUM_BLOCK_SIZE / 2 )
+		return 0;
+
+	size_t order = map_size_to_order(requested_size);
+	size_t current = *block_state(ptr) & BLOCK_ORDER_MASK;
+
+	if ( order == current )
+		return 1;
+
+	pthread_mutex_lock(&heap_lock);
 
-		while ( next_available_order < NUMBER_OF_LEVELS && free_lists[next_available_order] == NULL ){
-			++next_available_order;
+	if ( order < current ) {
+		// Split off the upper halves, the lower half keeps the data
+		while ( current > order ) {
+			current--;
+			add_to_free_list(find_buddy(ptr, current), current, 0);
+			splits++;
 		}
 
-		if ( next_available_order == NUMBER_OF_LEVELS ) {
-			// We found no free blocks in any list. The system has reached a state of full capacity
-			errno = ENOMEM;
-			return NULL;
+		*block_state(ptr) = order;
+
+		pthread_mutex_unlock(&heap_lock);
+		return 1;
+	}
+
+	// First check that every buddy up to the requested order can be had
+	uintptr_t offset = (uintptr_t) ptr - TOP_OF_THE_HEAP(ptr);
+
+	for ( ; current < order; current++ ) {
+		void * buddy = ptr + block_sizes[current];
+
+		if ( (offset & block_sizes[current]) != 0 || !is_free_block(buddy, current) ) {
+			pthread_mutex_unlock(&heap_lock);
+			return 0;
 		}
+	}
 
-		// next_available order represents a number in the free_lists where we can find a free block! 
-		// It is of a higher order so we now have to split it accordingly.
+	for ( current = *block_state(ptr) & BLOCK_ORDER_MASK; current < order; current++ ) {
+		remove_from_free_list(ptr + block_sizes[current], current);
+		merges++;
+	}
+
+	*block_state(ptr) = order;
+
+	pthread_mutex_unlock(&heap_lock);
+	return 1;
+}
 
-		while ( next_available_order >= order ) {
-		//	printf("next_available_order: %zu\n", next_available_order);
-			
-			meta_info * block = free_lists[next_available_order]; // guaranteed to be found
+static thread_cache * get_thread_cache();
 
-			if ( next_available_order == order ) {
-				remove_from_free_list(block, block->order);
-				return (void*)block + sizeof(meta_info);
-			} else {
-				// Splitting is required
-	//			meta_info * old_list_entry_next = block->succ;
-				remove_from_free_list(block, next_available_order);
+// Whether the checks are on, the environment is read on the first call
+static int checks_on()
+{
+	get_thread_cache();
+	return checking;
+}
 
-				block->order = next_available_order - 1;
-				block->free = 1;
+// 'size' with room for the canary, SIZE_MAX if that does not fit
+static size_t with_canary(size_t size)
+{
+	return size + canary_size < size ? SIZE_MAX : size + canary_size;
+}
 
-				meta_info * new_buddy = find_buddy(block);
+// The canary is the last word of the payload of 'size' bytes
+static uintptr_t * canary_of(void * ptr, size_t size)
+{
+	return (uintptr_t*) (ptr + size) - 1;
+}
 
-				new_buddy->free = 1;
-				new_buddy->order = block->order;
+static uintptr_t canary_value(void * ptr, size_t size)
+{
+	return canary_secret ^ (uintptr_t) ptr ^ size;
+}
 
-				add_to_free_list(block);
-				add_to_free_list(new_buddy);
+// Writes the canary of a block that is handed out, if checking
+static void * arm(void * ptr)
+{
+	if ( ptr != NULL && checking ) {
+		size_t size = payload_size(ptr);
 
-				next_available_order--;
-			}
+		*canary_of(ptr, size) = canary_value(ptr, size);
+	}
 
-		}
+	return ptr;
+}
 
-		// We could not split the memory until we found a block
-		errno = ENOMEM;
-		return NULL;
+static void report(const char * operation, void * ptr, const char * problem)
+{
+	print_line(STDERR_FILENO, "our_malloc: %s(%p): %s\n", operation, ptr, problem);
+	abort();
+}
 
+/*
+* Checks that ptr is a block in use, before it is freed or resized:
+* it must be where a block of its kind starts, and have its canary.
+* The region of a pointer that is not in the heap may not be mapped,
+* reading its kind can still crash. Returns the size of the payload.
+*/
+static size_t check_block(const char * operation, void * ptr)
+{
+	region * r = region_of(ptr);
+	uintptr_t offset = (uintptr_t) ptr - (uintptr_t) r;
+
+	if ( (uintptr_t) ptr % ALIGNMENT_SIZE_FOR_MALLOC != 0 )
+		report(operation, ptr, "invalid pointer");
+
+	if ( r->kind == LARGE_CHUNK_REGION ) {
+		if ( offset < LARGE_CHUNK_HEADER || offset >= r->length )
+			report(operation, ptr, "invalid pointer");
+	} else if ( r->kind != ARENA_REGION || offset < block_sizes[table_block_order()] ) {
+		report(operation, ptr, "invalid pointer");
+	} else if ( *block_state(ptr) & BLOCK_SLAB ) {
+		slab_page * page = slab_page_of(ptr);
+		uintptr_t first = (uintptr_t) page + SLAB_FIRST_OBJECT;
+
+		if ( page->size_class >= NUMBER_OF_SLAB_CLASSES || (uintptr_t) ptr < first || ((uintptr_t) ptr - first) % slab_sizes[page->size_class] != 0 )
+			report(operation, ptr, "invalid pointer");
 	} else {
-		// One exists!
-		//fprintf(stderr,"En funnen\n");
-		remove_from_free_list(aspirant, aspirant->order);
-		return (void*)aspirant + sizeof(meta_info);
+		unsigned char state = *block_state(ptr);
+
+		if ( state & BLOCK_FREE )
+			report(operation, ptr, "double free");
+
+		if ( (state & BLOCK_ORDER_MASK) >= NUMBER_OF_LEVELS || offset % block_sizes[state & BLOCK_ORDER_MASK] != 0 )
+			report(operation, ptr, "invalid pointer");
 	}
 
+	size_t size = payload_size(ptr);
+
+	if ( r->kind == ARENA_REGION && offset + size > MAXIMUM_BLOCK_SIZE )
+		report(operation, ptr, "corrupted block table");
+
+	if ( *canary_of(ptr, size) == ~canary_value(ptr, size) )
+		report(operation, ptr, "double free");
+
+	if ( *canary_of(ptr, size) != canary_value(ptr, size) )
+		report(operation, ptr, "corrupted canary");
+
+	return size;
 }
 
-void free(void * ptr)
+static int is_poisoned(unsigned char * bytes, size_t size)
 {
-	meta_info * block;
-	meta_info * buddy;
-	size_t order;
-	intptr_t diff;
+	size_t i;
 
-	if ( ptr == NULL )
+	for ( i = 0; i < size; i++ )
+		if ( bytes[i] != QUARANTINE_POISON )
+			return 0;
+
+	return 1;
+}
+
+// Frees a block that has left the quarantine
+static void quarantine_leave(void * ptr)
+{
+	size_t size = payload_size(ptr);
+
+	if ( *canary_of(ptr, size) != ~canary_value(ptr, size) || !is_poisoned(ptr, size - canary_size) )
+		report("free", ptr, "written after free");
+
+	release(ptr);
+}
+
+/*
+* Frees a block with a payload of 'size' bytes that has been checked.
+* Its canary is inverted and, if there is room, it waits in the
+* quarantine.
+*/
+static void checked_release(void * ptr, size_t size)
+{
+	*canary_of(ptr, size) = ~canary_value(ptr, size);
+	size -= canary_size;
+
+	if ( size > quarantine_limit ) {
+		release(ptr);
 		return;
+	}
 
-	block = (meta_info*) (ptr - sizeof(meta_info));
-	buddy = find_buddy(block);
-	order = block->order;
-	block->free = 1;
+	memset(ptr, QUARANTINE_POISON, size);
 
-	remove_from_free_list(block, block->order);
+	pthread_mutex_lock(&quarantine_lock);
 
-	while ( buddy->free && (buddy->order == block->order) ) {
-		// Merge the blocks recursively
+	while ( quarantine_length == QUARANTINE_SLOTS || quarantine_bytes + size > quarantine_limit ) {
+		void * oldest = quarantine[quarantine_head];
 
-		if ( buddy < block ) {
-			meta_info * tmp = buddy;
-			buddy = block;
-			block = tmp;
-		}
+		quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+		quarantine_length--;
+		quarantine_bytes -= payload_size(oldest) - canary_size;
+
+		pthread_mutex_unlock(&quarantine_lock);
+		quarantine_leave(oldest);
+		pthread_mutex_lock(&quarantine_lock);
+	}
+
+	quarantine[(quarantine_head + quarantine_length) % QUARANTINE_SLOTS] = ptr;
+	quarantine_length++;
+	quarantine_bytes += size;
 
-		remove_from_free_list(buddy, buddy->order);
-		remove_from_free_list(block, block->order);
-		
-		block->order += 1;
-		block->free = 1;
+	pthread_mutex_unlock(&quarantine_lock);
+}
 
-		add_to_free_list(block);
-		buddy = find_buddy(block);
-	} 
+// Frees the old block of a realloc as free() does, poisoned and held back if checking
+static void release_reallocated(void * ptr)
+{
+	if ( checking )
+		checked_release(ptr, payload_size(ptr));
+	else
+		release(ptr);
+}
+
+static int is_arena(region * r)
+{
+	size_t i;
+
+	for ( i = 0; i < number_of_arenas; i++ )
+		if ( arenas[i] == r )
+			return 1;
+
+	return 0;
+}
+
+/*
+* Walks the block table of every arena: each block must start at a
+* multiple of its size, and a free block never has a free buddy of
+* its order. Then the free lists: every block in them must be free,
+* of the order of the list, and linked both ways, and all free blocks
+* must be in a list. Blocks in use, large chunks and the contents of
+* slab pages are left to the checks of free, the threads may be
+* writing them. The heap lock is held throughout.
+*/
+void malloc_check_heap()
+{
+	size_t free_in_tables = 0, free_in_lists = 0;
+	size_t i, order;
+
+	pthread_mutex_lock(&heap_lock);
+
+	for ( i = 0; i < number_of_arenas; i++ ) {
+		region * arena = arenas[i];
+		uintptr_t offset = 0;
+
+		if ( arena->kind != ARENA_REGION )
+			report("malloc_check_heap", arena, "corrupted arena");
+
+		while ( offset < MAXIMUM_BLOCK_SIZE ) {
+			void * block = (void*) arena + offset;
+			unsigned char state = *block_state(block);
+
+			order = state & BLOCK_ORDER_MASK;
+
+			if ( order >= NUMBER_OF_LEVELS || offset % block_sizes[order] != 0 )
+				report("malloc_check_heap", block, "corrupted block table");
+
+			if ( state & BLOCK_FREE ) {
+				if ( order < NUMBER_OF_LEVELS - 1 && is_free_block(find_buddy(block, order), order) )
+					report("malloc_check_heap", block, "free buddies not merged");
+
+				free_in_tables++;
+			}
+
+			offset += block_sizes[order];
+		}
+	}
+
+	// A link is followed only once it is known to point into an arena
+	for ( i = 0; i < number_of_nodes * NUMBER_OF_LEVELS; i++ ) {
+		size_t node = i / NUMBER_OF_LEVELS;
+		meta_info * previous = NULL;
+		meta_info * walk;
+
+		order = i % NUMBER_OF_LEVELS;
+
+		for ( walk = free_lists[node][order]; walk != NULL; previous = walk, walk = walk->succ ) {
+			if ( !is_arena(region_of(walk)) || region_of(walk)->node != node || !is_free_block(walk, order) || walk->pred != previous )
+				report("malloc_check_heap", walk, "corrupted free list");
+
+			free_in_lists++;
+		}
+	}
+
+	if ( free_in_tables != free_in_lists )
+		report("malloc_check_heap", NULL, "free block missing from its list");
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+typedef struct heap_map_writer {
+	int fd;
+	size_t length;
+	malloc_heap_map_record records[HEAP_MAP_BUFFER_RECORDS];
+} heap_map_writer;
+
+static void heap_map_flush(heap_map_writer * writer)
+{
+	char * data = (char*) writer->records;
+	size_t left = writer->length * sizeof(malloc_heap_map_record);
+
+	while ( left > 0 ) {
+		ssize_t written = write(writer->fd, data, left);
+
+		if ( written <= 0 )
+			break;
+
+		data += written;
+		left -= written;
+	}
+
+	writer->length = 0;
+}
+
+static void heap_map_add(heap_map_writer * writer, uint32_t kind, uint32_t order, uint64_t offset, uint64_t size)
+{
+	malloc_heap_map_record * record = &writer->records[writer->length++];
+
+	record->kind = kind;
+	record->order = order;
+	record->offset = offset;
+	record->size = size;
+
+	if ( writer->length == HEAP_MAP_BUFFER_RECORDS )
+		heap_map_flush(writer);
+}
+
+/*
+* Every arena with all of its blocks as the block table has them.
+* Blocks in the caches of the threads and deferred blocks are in use
+* as far as the table knows. Large chunks are left out.
+*/
+void malloc_dump_heap(int fd)
+{
+	heap_map_writer writer;
+	size_t i;
+
+	writer.fd = fd;
+	writer.length = 0;
+
+	pthread_mutex_lock(&heap_lock);
+
+	heap_map_add(&writer, MALLOC_HEAP_MAP_START, MALLOC_HEAP_MAP_BUDDY, 0, heap_size);
+
+	for ( i = 0; i < number_of_arenas; i++ ) {
+		region * arena = arenas[i];
+		uintptr_t offset = 0;
+
+		heap_map_add(&writer, MALLOC_HEAP_MAP_REGION, arena->node, (uintptr_t) arena, MAXIMUM_BLOCK_SIZE);
+
+		while ( offset < MAXIMUM_BLOCK_SIZE ) {
+			unsigned char state = *block_state((void*) arena + offset);
+			size_t order = state & BLOCK_ORDER_MASK;
+			uint32_t kind = MALLOC_HEAP_MAP_USED;
+
+			if ( order >= NUMBER_OF_LEVELS )
+				break;
+
+			if ( state & BLOCK_FREE )
+				kind = MALLOC_HEAP_MAP_FREE;
+			else if ( state & BLOCK_SLAB )
+				kind = MALLOC_HEAP_MAP_SLAB;
+
+			heap_map_add(&writer, kind, order, offset, block_sizes[order]);
+			offset += block_sizes[order];
+		}
+	}
+
+	heap_map_flush(&writer);
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+static void request_heap_map(int number)
+{
+	(void) number;
+	heap_map_requested = 1;
+}
+
+void * calloc(size_t count, size_t size)
+{
+
+#ifdef WRITE_LIFTED
+	setvbuf(stderr, NULL, _IONBF, 0);
+	fprintf(stderr, "lifted (so far): %d\n", page_source_extend(0) - start);
+#endif
+
+#ifdef DEBUG_OUR_MALLOC
+	//printf("CALLOC CALLED\n");
+#endif
+
+	size_t total;
+	void * request = NULL;
+
+	if ( __builtin_mul_overflow(count, size, &total) ) {
+		total = SIZE_MAX;
+		errno = ENOMEM;
+	} else {
+		request = checks_on() ? arm(zeroed_allocate(with_canary(total))) : zeroed_allocate(total);
+	}
+
+	record_call(MALLOC_TRACE_CALLOC, NULL, total, request);
+	return request;
+}
+
+static void * reallocate(void * ptr, size_t size)
+{
+
+	if ( ptr == NULL ) {
+		// realloc(NULL, size) should be identical to malloc(size)
+		return allocate(size);
+	} else if ( size == 0 ) {
+		// If size is zero and ptr is not NULL, a new, minimum sized object is
+    	// allocated and the original object is freed.
+		release_reallocated(ptr);
+		return allocate(10); // lets say 10 is our minimum size object.
+	}
+
+	if ( resize_in_place(ptr, size) ) {
+		__sync_fetch_and_add(&reallocs_in_place, 1);
+		return ptr;
+	}
+
+	void * tmp = allocate(size);
+
+	if ( tmp == NULL )
+		return NULL;
+
+	size_t old_size = payload_size(ptr);
+
+	if ( tmp != ptr )
+		memcpy(tmp, ptr, old_size < size ? old_size : size );
+	release_reallocated(ptr);
+
+	return tmp;
+}
+
+void * realloc(void * ptr, size_t size)
+{
+	void * result;
+
+	if ( checks_on() && ptr != NULL ) {
+		// Inverted first, the old block may be freed
+		size_t old_size = check_block("realloc", ptr);
+
+		*canary_of(ptr, old_size) = ~canary_value(ptr, old_size);
+		// A size of 0 frees the block and gives a new one, as unchecked
+		result = reallocate(ptr, size == 0 ? 0 : with_canary(size));
+		arm(result != NULL || size == 0 ? result : ptr);
+	} else {
+		result = arm(reallocate(ptr, with_canary(size)));
+	}
+
+	record_call(MALLOC_TRACE_REALLOC, ptr, size, result);
+	return result;
+}
+
+size_t realloc_in_place_count()
+{
+	return reallocs_in_place;
+}
+
+static int merge_all_deferred(size_t node);
+
+// The lowest order from 'order' up with a free block of the node, NUMBER_OF_LEVELS if none
+static size_t first_free_order(size_t node, size_t order)
+{
+	while ( order < NUMBER_OF_LEVELS && free_lists[node][order] == NULL )
+		order++;
+
+	return order;
+}
+
+/*
+* Takes a block of the given order from the deferred blocks or the
+* free lists of the node of the calling thread, splitting a larger one
+* if needed. Only when the node has no memory left and can get none is
+* a block of another node taken. The heap lock must be held. If
+* 'zeroed' is not NULL it is set to whether the block holds only
+* zeroes past its first sizeof(meta_info) bytes.
+*/
+static void * buddy_allocate(size_t order, int * zeroed)
+{
+	size_t node = this_thread_cache.node;
+
+	if ( order < DEFERRED_ORDERS && deferred_blocks[node][order] != NULL ) {
+		void * block = deferred_blocks[node][order];
+
+		deferred_blocks[node][order] = *(void**) block;
+		deferred_count[node][order]--;
+		region_of(block)->blocks_deferred--;
+
+		if ( zeroed != NULL )
+			*zeroed = 0;
+
+		return block;
+	}
+
+	size_t next_available_order = first_free_order(node, order);
+
+	// Merging what was deferred may make a large enough block
+	if ( next_available_order == NUMBER_OF_LEVELS && merge_all_deferred(node) )
+		next_available_order = first_free_order(node, order);
+
+	if ( next_available_order == NUMBER_OF_LEVELS ) {
+		// We found no free blocks in any list. All arenas have reached
+		// a state of full capacity, so the heap grows by one more.
+		if ( add_arena(node) ) {
+			while ( free_lists[node][next_available_order - 1] == NULL )
+				--next_available_order;
+			--next_available_order;
+
+			if ( next_available_order < order )
+				return NULL;
+		} else {
+			// Memory of another node is better than none
+			for ( node = 0; node < number_of_nodes; node++ )
+				if ( (next_available_order = first_free_order(node, order)) < NUMBER_OF_LEVELS )
+					break;
+
+			if ( node == number_of_nodes )
+				return NULL;
+		}
+	}
+
+	// next_available order represents a number in the free_lists where we can find a free block! 
+	// If it is of a higher order we now have to split it accordingly.
+	void * block = free_lists[node][next_available_order];
+	unsigned char block_zeroed = *block_state(block) & BLOCK_ZEROED;
+
+	remove_from_free_list(block, next_available_order);
+
+	// The halves of a cleared block are cleared too
+	while ( next_available_order > order ) {
+		next_available_order--;
+		add_to_free_list(find_buddy(block, next_available_order), next_available_order, block_zeroed);
+		splits++;
+	}
+
+	*block_state(block) = order;
+	region_of(block)->blocks_in_use++;
+
+	if ( zeroed != NULL )
+		*zeroed = block_zeroed != 0;
+
+	return block;
+}
+
+/*
+* Takes an extent for 'size' bytes, see EXTENT_MINIMUM. The heap
+* lock must be held. 'zeroed' is as for buddy_allocate().
+*/
+static void * extent_allocate(size_t size, int * zeroed)
+{
+	size_t piece_size = block_sizes[EXTENT_PIECE_ORDER];
+	size_t length = (size + piece_size - 1) & ~(piece_size - 1);
+	size_t order = map_size_to_order(length);
+	int block_zeroed;
+	void * block = buddy_allocate(order, &block_zeroed);
+
+	if ( block == NULL )
+		return NULL;
+
+	// Halve what is left of the block: a lower half that is needed
+	// as a whole is kept, an upper half that is not is given back.
+	void * piece = block;
+
+	while ( length < block_sizes[order] ) {
+		order--;
+
+		if ( length > block_sizes[order] ) {
+			*block_state(piece) = order | BLOCK_CONTINUED;
+			region_of(block)->blocks_in_use++;
+
+			piece += block_sizes[order];
+			length -= block_sizes[order];
+		} else {
+			add_to_free_list(piece + block_sizes[order], order, block_zeroed ? BLOCK_ZEROED : 0);
+		}
+
+		splits++;
+	}
+
+	*block_state(piece) = order;
+
+	if ( zeroed != NULL )
+		*zeroed = block_zeroed;
+
+	return block;
+}
+
+/*
+* An arena is free when the upper halves of all orders are. The
+* largest is looked at first, it is the one most likely in use.
+*/
+static int arena_is_free(region * arena)
+{
+	size_t order;
+
+	for ( order = NUMBER_OF_LEVELS - 1; order-- > table_block_order(); )
+		if ( !is_free_block((void*) arena + block_sizes[order], order) )
+			return 0;
+
+	return 1;
+}
+
+/*
+* Whether the node of the arena has another one. The last arena of a
+* node is kept, or a node whose blocks come and go would give it back
+* and make it again each time.
+*/
+static int node_has_another_arena(region * arena)
+{
+	size_t i;
+
+	for ( i = 0; i < number_of_arenas; i++ )
+		if ( arenas[i] != (void*) arena && ((region*) arenas[i])->node == arena->node )
+			return 1;
+
+	return 0;
+}
+
+/*
+* Gives an arena that is entirely free back to the system. Returns 0
+* if it is on the break but not the uppermost thing there, it is
+* then left as it is. The heap lock must be held.
+*/
+static int release_arena(region * arena)
+{
+	size_t order, i;
+
+	if ( arena->length == 0 && page_source_extend(0) != (void*) arena + MAXIMUM_BLOCK_SIZE )
+		return 0;
+
+	for ( order = table_block_order(); order < NUMBER_OF_LEVELS - 1; order++ )
+		remove_from_free_list((void*) arena + block_sizes[order], order);
+
+	for ( i = 0; arenas[i] != arena; i++ )
+		;
+
+	arenas[i] = arenas[--number_of_arenas];
+	heap_size -= MAXIMUM_BLOCK_SIZE;
+
+	if ( arena->length != 0 ) {
+		munmap(arena, MAXIMUM_BLOCK_SIZE);
+		return 1;
+	}
+
+	page_source_extend(-MAXIMUM_BLOCK_SIZE);
+
+	// The arena below may have been waiting for this one to go
+	region * below = page_source_extend(0) - MAXIMUM_BLOCK_SIZE;
+
+	for ( i = 0; i < number_of_arenas; i++ )
+		if ( arenas[i] == below && node_has_another_arena(below) && arena_is_free(below) )
+			return release_arena(below);
+
+	return 1;
+}
+
+/*
+* Gives the whole arena of a block that was just freed back to the
+* system if nothing in it is in use, or else the pages of the block
+* if it is large enough. Those come back cleared, so once the rest
+* of the first page is cleared as well the block is marked zeroed.
+* The heap lock must be held.
+*/
+static void trim(void * block, size_t order)
+{
+	region * arena = region_of(block);
+
+	if ( node_has_another_arena(arena) && arena_is_free(arena) && release_arena(arena) )
+		return;
+
+	// A block of one page or less has no pages past its first
+	if ( block_sizes[order] >= trim_threshold && block_sizes[order] > TRIM_PAGE_SIZE ) {
+		// Cleared only if the pages were given back
+		if ( madvise(block + TRIM_PAGE_SIZE, block_sizes[order] - TRIM_PAGE_SIZE, MADV_DONTNEED) == 0 ) {
+			memset(block + sizeof(meta_info), 0, TRIM_PAGE_SIZE - sizeof(meta_info));
+			*block_state(block) |= BLOCK_ZEROED;
+		}
+	}
+}
+
+/*
+* Gives a block back to the free lists, merging it with its
+* buddy as far up as possible. The heap lock must be held.
+*/
+static void buddy_release(void * block)
+{
+	size_t order = *block_state(block) & BLOCK_ORDER_MASK;
+
+	region_of(block)->blocks_in_use--;
+
+	// The block of the highest order spans the whole heap and has no buddy.
+	while ( order < NUMBER_OF_LEVELS - 1 ) {
+		void * buddy = find_buddy(block, order);
+
+		if ( !is_free_block(buddy, order) )
+			break;
+
+		// Merge the blocks recursively, the merged block
+		// starts at the lower of the two addresses.
+		remove_from_free_list(buddy, order);
+
+		if ( buddy < block )
+			block = buddy;
+
+		order += 1;
+		merges++;
+	}
+
+	add_to_free_list(block, order, 0);
+
+	if ( trim_threshold != 0 )
+		trim(block, order);
+}
+
+/*
+* Merges up to 'n' of the deferred blocks of the given node and
+* order with their buddies. The heap lock must be held.
+*/
+static void merge_deferred(size_t node, size_t order, size_t n)
+{
+	while ( n-- > 0 && deferred_blocks[node][order] != NULL ) {
+		void * block = deferred_blocks[node][order];
+
+		deferred_blocks[node][order] = *(void**) block;
+		deferred_count[node][order]--;
+		region_of(block)->blocks_deferred--;
+
+		buddy_release(block);
+	}
+}
+
+/*
+* Merges the deferred blocks of one arena with their buddies.
+* The heap lock must be held.
+*/
+static void merge_deferred_in(region * arena)
+{
+	void * blocks = NULL;
+	size_t order;
+
+	// Taken out of the lists first, the last merge may release the arena
+	for ( order = TCACHE_ORDERS; order < DEFERRED_ORDERS; order++ ) {
+		void ** link = &deferred_blocks[arena->node][order];
+
+		while ( *link != NULL ) {
+			void * block = *link;
+
+			if ( region_of(block) != arena ) {
+				link = (void**) block;
+				continue;
+			}
+
+			*link = *(void**) block;
+			deferred_count[arena->node][order]--;
+
+			*(void**) block = blocks;
+			blocks = block;
+		}
+	}
+
+	arena->blocks_deferred = 0;
+
+	while ( blocks != NULL ) {
+		void * block = blocks;
+
+		blocks = *(void**) block;
+		buddy_release(block);
+	}
+}
+
+/*
+* Merges all deferred blocks of a node. Returns 0 if there were
+* none. The heap lock must be held.
+*/
+static int merge_all_deferred(size_t node)
+{
+	size_t order;
+	int merged = 0;
+
+	for ( order = TCACHE_ORDERS; order < DEFERRED_ORDERS; order++ ) {
+		merged |= deferred_blocks[node][order] != NULL;
+		merge_deferred(node, order, deferred_count[node][order]);
+	}
+
+	return merged;
+}
+
+/*
+* Gives back the blocks of an extent one by one, they merge
+* with each other as they go. The heap lock must be held.
+*/
+static void extent_release(void * ptr)
+{
+	unsigned char state;
+
+	do {
+		state = *block_state(ptr);
+
+		void * next = ptr + block_sizes[state & BLOCK_ORDER_MASK];
+
+		buddy_release(ptr);
+		ptr = next;
+	} while ( state & BLOCK_CONTINUED );
+}
+
+/*
+* Takes a new page for the given node and class from the buddy system
+* and cuts it into objects. The lock of the class must be held.
+*/
+static slab_page * slab_page_create(size_t node, size_t size_class)
+{
+	pthread_mutex_lock(&heap_lock);
+
+	slab_page * page = buddy_allocate(SLAB_PAGE_ORDER, NULL);
+
+	if ( page != NULL )
+		memset(block_state(page), BLOCK_SLAB | SLAB_PAGE_ORDER, SLAB_PAGE_SIZE >> MINIMUM_BLOCK_ORDER);
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if ( page == NULL )
+		return NULL;
+
+	size_t object_size = slab_sizes[size_class];
+	size_t count = (SLAB_PAGE_SIZE - SLAB_FIRST_OBJECT) / object_size;
+
+	page->size_class = size_class;
+	page->node = node;
+	page->in_use = 0;
+	page->free_objects = NULL;
+
+	// Link the objects so that they are handed out in address order
+	while ( count-- > 0 ) {
+		void * object = (char*) page + SLAB_FIRST_OBJECT + count * object_size;
+
+		*(void**) object = page->free_objects;
+		page->free_objects = object;
+	}
+
+	page->prev = NULL;
+	page->next = slab_classes[node][size_class].partial;
+
+	if ( page->next != NULL )
+		page->next->prev = page;
+
+	slab_classes[node][size_class].partial = page;
+
+	return page;
+}
+
+static void slab_unlink_page(slab_page * page)
+{
+	if ( page->prev != NULL )
+		page->prev->next = page->next;
+	else
+		slab_classes[page->node][page->size_class].partial = page->next;
+
+	if ( page->next != NULL )
+		page->next->prev = page->prev;
+}
+
+static void take_remote_frees(thread_cache * cache);
+
+/*
+* Moves up to TCACHE_BATCH objects of the given class from the
+* slab pages of its node into the cache of the calling thread,
+* unless the remote frees of the node had some.
+*/
+static void slab_refill(thread_cache * cache, size_t size_class)
+{
+	slab_class * class = &slab_classes[cache->node][size_class];
+	size_t n = 0;
+
+	take_remote_frees(cache);
+
+	if ( cache->objects[size_class] != NULL )
+		return;
+
+	pthread_mutex_lock(&class->lock);
+
+	while ( n < TCACHE_BATCH ) {
+		slab_page * page = class->partial;
+
+		if ( page == NULL && (page = slab_page_create(cache->node, size_class)) == NULL )
+			break;
+
+		// Take what the page has, a full page leaves the list
+		while ( page->free_objects != NULL && n < TCACHE_BATCH ) {
+			void * object = page->free_objects;
+
+			page->free_objects = *(void**) object;
+			page->in_use++;
+
+			*(void**) object = cache->objects[size_class];
+			cache->objects[size_class] = object;
+			n++;
+		}
+
+		if ( page->free_objects == NULL )
+			slab_unlink_page(page);
+	}
+
+	cache->object_count[size_class] += n;
+
+	pthread_mutex_unlock(&class->lock);
+}
+
+/*
+* Puts an object back in its page. A page that becomes empty goes
+* back to the buddy system unless it is the only one of its class
+* with free objects. The lock of the class of the page must be held.
+*/
+static void slab_free_object(slab_class * class, void * object)
+{
+	slab_page * page = slab_page_of(object);
+
+	if ( page->free_objects == NULL ) {
+		// The page was full, it has a free object again
+		page->prev = NULL;
+		page->next = class->partial;
+
+		if ( page->next != NULL )
+			page->next->prev = page;
+
+		class->partial = page;
+	}
+
+	*(void**) object = page->free_objects;
+	page->free_objects = object;
+	page->in_use--;
+
+	if ( page->in_use == 0 && (page->prev != NULL || page->next != NULL) ) {
+		slab_unlink_page(page);
+
+		pthread_mutex_lock(&heap_lock);
+		*block_state(page) = SLAB_PAGE_ORDER;
+		buddy_release(page);
+		pthread_mutex_unlock(&heap_lock);
+	}
+}
+
+/*
+* Gives back 'n' objects of the given class from the cache of the
+* calling thread to their pages, which are all of its node.
+*/
+static void slab_drain(thread_cache * cache, size_t size_class, size_t n)
+{
+	slab_class * class = &slab_classes[cache->node][size_class];
+
+	pthread_mutex_lock(&class->lock);
+
+	while ( n-- > 0 && cache->objects[size_class] != NULL ) {
+		void * object = cache->objects[size_class];
+
+		cache->objects[size_class] = *(void**) object;
+		cache->object_count[size_class]--;
+
+		slab_free_object(class, object);
+	}
+
+	pthread_mutex_unlock(&class->lock);
+}
+
+/*
+* Moves up to TCACHE_BATCH blocks of the given order from the
+* free lists of its node into the cache of the calling thread,
+* unless the remote frees of the node had some.
+*/
+static void thread_cache_refill(thread_cache * cache, size_t order)
+{
+	size_t n;
+
+	take_remote_frees(cache);
+
+	if ( cache->blocks[order] != NULL )
+		return;
+
+	pthread_mutex_lock(&heap_lock);
+
+	for ( n = 0; n < TCACHE_BATCH; n++ ) {
+		void * block = buddy_allocate(order, NULL);
+
+		if ( block == NULL )
+			break;
+
+		*(void**) block = cache->blocks[order];
+		cache->blocks[order] = block;
+		cache->count[order]++;
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+* Gives back 'n' blocks of the given order from the cache
+* of the calling thread to the shared free lists.
+*/
+static void thread_cache_drain(thread_cache * cache, size_t order, size_t n)
+{
+	pthread_mutex_lock(&heap_lock);
+
+	while ( n-- > 0 && cache->blocks[order] != NULL ) {
+		void * block = cache->blocks[order];
+
+		cache->blocks[order] = *(void**) block;
+		cache->count[order]--;
+
+		buddy_release(block);
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+/*
+* Takes a whole stack of remote frees, or of arenas that have them.
+*/
+static void * take_stack(void ** stack)
+{
+	void * top;
+
+	do {
+		top = *(void * volatile *) stack;
+	} while ( top != NULL && !__sync_bool_compare_and_swap(stack, top, NULL) );
+
+	return top;
+}
+
+/*
+* Pushes the blocks or objects from 'first' to 'last', linked through
+* their first word, on the remote frees of their arena. They must have
+* been counted with reserve_remote() first, so that a taker never
+* subtracts more than there is.
+*/
+static void push_remote(region * arena, void * first, void * last)
+{
+	void * top;
+
+	do {
+		top = *(void * volatile *) &arena->remote_frees;
+		*(void**) last = top;
+	} while ( !__sync_bool_compare_and_swap(&arena->remote_frees, top, first) );
+
+	if ( top != NULL )
+		return;
+
+	// The stack was empty, so the arena is on no list of its node. It
+	// cannot be taken off one before its frees are taken, and pushes
+	// until then see a stack that is not empty.
+	region * next;
+
+	do {
+		next = *(region * volatile *) &remote_arenas[arena->node];
+		arena->next_remote = next;
+	} while ( !__sync_bool_compare_and_swap(&remote_arenas[arena->node], next, arena) );
+}
+
+/*
+* Counts 'n' more remote frees for a node if it has room for them.
+* Returns 0, counting nothing, if it has not.
+*/
+static int reserve_remote(size_t node, size_t n)
+{
+	size_t count;
+
+	do {
+		count = *(volatile size_t *) &remote_count[node];
+
+		if ( count + n > REMOTE_CAPACITY )
+			return 0;
+	} while ( !__sync_bool_compare_and_swap(&remote_count[node], count, count + n) );
+
+	return 1;
+}
+
+/*
+* Moves up to 'n' blocks or objects from the front of a list of the
+* cache of the calling thread to the remote frees of their arenas, a
+* run of them in the same arena at a time, while the node of the arena
+* has room. Returns how many of the 'n' were not moved.
+*/
+static size_t spill_to_remote(void ** list, size_t * count, size_t n)
+{
+	while ( n > 0 && *list != NULL ) {
+		void * first = *list;
+		void * last = first;
+		region * arena = region_of(first);
+		size_t run = 1;
+
+		while ( run < n && *(void**) last != NULL && region_of(*(void**) last) == arena ) {
+			last = *(void**) last;
+			run++;
+		}
+
+		if ( !reserve_remote(arena->node, run) )
+			break;
+
+		*list = *(void**) last;
+		*count -= run;
+		n -= run;
+
+		push_remote(arena, first, last);
+	}
+
+	return n;
+}
+
+/*
+* Keeps a block or object taken from the remote frees in the cache of
+* the calling thread, draining the cache under the locks if it is full.
+*/
+static void keep_remote_free(thread_cache * cache, void * ptr)
+{
+	slab_page * page = slab_page_of(ptr);
+
+	if ( page == NULL ) {
+		size_t order = *block_state(ptr) & BLOCK_ORDER_MASK;
+
+		*(void**) ptr = cache->blocks[order];
+		cache->blocks[order] = ptr;
+		cache->count[order]++;
+
+		if ( cache->count[order] > TCACHE_CAPACITY )
+			thread_cache_drain(cache, order, TCACHE_BATCH);
+	} else if ( page->node != cache->node ) {
+		// A page taken from another node when this one had no memory
+		slab_class * class = &slab_classes[page->node][page->size_class];
+
+		pthread_mutex_lock(&class->lock);
+		slab_free_object(class, ptr);
+		pthread_mutex_unlock(&class->lock);
+	} else {
+		*(void**) ptr = cache->objects[page->size_class];
+		cache->objects[page->size_class] = ptr;
+		cache->object_count[page->size_class]++;
+
+		if ( cache->object_count[page->size_class] > TCACHE_CAPACITY )
+			slab_drain(cache, page->size_class, TCACHE_BATCH);
+	}
+}
+
+/*
+* Gives a block or object taken from the remote frees of a node with
+* no threads back under the locks.
+*/
+static void release_remote_free(void * ptr)
+{
+	slab_page * page = slab_page_of(ptr);
+
+	if ( page == NULL ) {
+		pthread_mutex_lock(&heap_lock);
+		buddy_release(ptr);
+		pthread_mutex_unlock(&heap_lock);
+	} else {
+		slab_class * class = &slab_classes[page->node][page->size_class];
+
+		pthread_mutex_lock(&class->lock);
+		slab_free_object(class, ptr);
+		pthread_mutex_unlock(&class->lock);
+	}
+}
+
+/*
+* Takes the remote frees of all arenas of a node, into the cache of
+* the calling thread, or back under the locks if 'cache' is NULL.
+*/
+static void take_remote_frees_of_node(size_t node, thread_cache * cache)
+{
+	if ( remote_arenas[node] == NULL )
+		return;
+
+	region * arena = take_stack((void**) &remote_arenas[node]);
+
+	while ( arena != NULL ) {
+		// Read before the frees are taken, a push after that puts
+		// the arena on the list again
+		region * next = arena->next_remote;
+		void * ptr = take_stack(&arena->remote_frees);
+		size_t n = 0;
+
+		while ( ptr != NULL ) {
+			void * following = *(void**) ptr;
+
+			if ( cache != NULL )
+				keep_remote_free(cache, ptr);
+			else
+				release_remote_free(ptr);
+
+			ptr = following;
+			n++;
+		}
+
+		__sync_fetch_and_sub(&remote_count[arena->node], n);
+		arena = next;
+	}
+}
+
+/*
+* Takes the remote frees of the node of the calling thread into its
+* cache.
+*/
+static void take_remote_frees(thread_cache * cache)
+{
+	take_remote_frees_of_node(cache->node, cache);
+}
+
+/*
+* Gives back the remote frees of the nodes that have no threads to
+* take them. No lock may be held.
+*/
+static void release_orphaned_remote_frees()
+{
+	size_t node;
+
+	for ( node = 0; node < number_of_nodes; node++ )
+		if ( remote_arenas[node] != NULL && *(volatile size_t *) &threads_on_node[node] == 0 )
+			take_remote_frees_of_node(node, NULL);
+}
+
+/*
+* Called when a thread that has used its cache exits.
+*/
+static void thread_cache_destroy(void * data)
+{
+	thread_cache * cache = data;
+	size_t order;
+
+	// What other threads handed back goes with the rest of the cache
+	take_remote_frees(cache);
+
+	for ( order = 0; order < TCACHE_ORDERS; order++ )
+		thread_cache_drain(cache, order, cache->count[order]);
+
+	for ( order = 0; order < NUMBER_OF_SLAB_CLASSES; order++ )
+		slab_drain(cache, order, cache->object_count[order]);
+
+	pthread_mutex_lock(&heap_lock);
+
+	for ( order = 0; order < NUMBER_OF_CALLS; order++ )
+		exited_calls[order] += cache->calls[order];
+
+	for ( order = 0; order < MALLOC_REQUEST_HISTOGRAM_SIZE; order++ )
+		exited_requests[order] += cache->requests[order];
+
+	if ( cache->prev != NULL )
+		cache->prev->next = cache->next;
+	else
+		thread_caches = cache->next;
+
+	if ( cache->next != NULL )
+		cache->next->prev = cache->prev;
+
+	threads_on_node[cache->node]--;
+
+	pthread_mutex_unlock(&heap_lock);
+
+	memset(cache->calls, 0, sizeof(cache->calls));
+	memset(cache->requests, 0, sizeof(cache->requests));
+
+	// Frees from later destructors register the cache again
+	cache->registered = 0;
+}
+
+static void at_exit();
+
+/*
+* Returns the number of nodes the system has online, one more than
+* the highest in a list like "0-1" or "0,2-3".
+*/
+static size_t count_nodes()
+{
+	char list[128];
+	int fd = open("/sys/devices/system/node/online", O_RDONLY);
+	ssize_t length = fd < 0 ? 0 : read(fd, list, sizeof(list) - 1);
+	size_t highest = 0, number = 0;
+	ssize_t i;
+
+	if ( fd >= 0 )
+		close(fd);
+
+	for ( i = 0; i < length; i++ ) {
+		if ( list[i] >= '0' && list[i] <= '9' ) {
+			number = number * 10 + list[i] - '0';
+		} else {
+			if ( number > highest )
+				highest = number;
+			number = 0;
+		}
+	}
+
+	if ( number > highest )
+		highest = number;
+
+	return highest + 1;
+}
+
+// The node of a thread that is being registered
+static uint32_t node_of_thread(uint32_t number)
+{
+	unsigned int cpu, node = 0;
+
+	if ( simulated_nodes )
+		return number % number_of_nodes;
+
+#ifdef SYS_getcpu
+	syscall(SYS_getcpu, &cpu, &node, NULL);
+#endif
+
+	return node % number_of_nodes;
+}
+
+static void initialize()
+{
+	// Read first, nothing may be handed out before
+	char * check = getenv("OUR_MALLOC_CHECK");
+	char * quarantine_size = getenv("OUR_MALLOC_QUARANTINE");
+	char * interval = getenv("OUR_MALLOC_VALIDATE");
+
+	if ( quarantine_size != NULL )
+		quarantine_limit = strtoul(quarantine_size, NULL, 0);
+
+	if ( interval != NULL )
+		validate_interval = strtoul(interval, NULL, 0);
+
+	if ( check != NULL || quarantine_size != NULL || interval != NULL ) {
+		checking = 1;
+		canary_size = sizeof(uintptr_t);
+		canary_secret = (uintptr_t) &canary_secret ^ getpid();
+
+#ifdef __linux__
+		// 16 random bytes the kernel gives every process
+		uintptr_t * random = (uintptr_t*) getauxval(AT_RANDOM);
+
+		if ( random != NULL )
+			canary_secret = *random;
+#endif
+	}
+
+	char * nodes = getenv("OUR_MALLOC_NODES");
+
+	if ( nodes != NULL ) {
+		number_of_nodes = strtoul(nodes, NULL, 0);
+		simulated_nodes = 1;
+	} else {
+		number_of_nodes = count_nodes();
+	}
+
+	if ( number_of_nodes < 1 )
+		number_of_nodes = 1;
+
+	if ( number_of_nodes > MAXIMUM_NUMBER_OF_NODES )
+		number_of_nodes = MAXIMUM_NUMBER_OF_NODES;
+
+	pthread_key_create(&thread_cache_key, thread_cache_destroy);
+
+	char * trace = getenv("OUR_MALLOC_TRACE");
+
+	if ( trace != NULL )
+		trace_fd = open(trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	print_statistics_at_exit = getenv("OUR_MALLOC_STATS") != NULL;
+
+	char * threshold = getenv("OUR_MALLOC_TRIM_THRESHOLD");
+
+	if ( threshold != NULL )
+		trim_threshold = strtoul(threshold, NULL, 0);
+
+	// Only whole pages can be given back
+	if ( trim_threshold != 0 && trim_threshold < TRIM_PAGE_SIZE )
+		trim_threshold = TRIM_PAGE_SIZE;
+
+	char * heap_map = getenv("OUR_MALLOC_HEAP_MAP");
+
+	if ( heap_map != NULL )
+		heap_map_fd = open(heap_map, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if ( heap_map_fd >= 0 ) {
+		struct sigaction action;
+
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = request_heap_map;
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR2, &action, NULL);
+	}
+
+	if ( trace_fd >= 0 || print_statistics_at_exit || heap_map_fd >= 0 )
+		atexit(at_exit);
+}
+
+static thread_cache * get_thread_cache()
+{
+	thread_cache * cache = &this_thread_cache;
+
+	if ( !cache->registered ) {
+		// Set first, initialize() may call back into the allocator
+		cache->registered = 1;
+
+		// Make sure the cache is drained when the thread exits
+		pthread_once(&initialize_once, initialize);
+		pthread_setspecific(thread_cache_key, cache);
+
+		pthread_mutex_lock(&heap_lock);
+
+		cache->number = number_of_threads++;
+		cache->node = node_of_thread(cache->number);
+		threads_on_node[cache->node]++;
+		cache->prev = NULL;
+		cache->next = thread_caches;
+
+		if ( thread_caches != NULL )
+			thread_caches->prev = cache;
+
+		thread_caches = cache;
+
+		pthread_mutex_unlock(&heap_lock);
+	}
+
+	return cache;
+}
+
+static void * allocate(size_t requested_size)
+{
+	if ( requested_size <= MAXIMUM_SLAB_SIZE ) {
+		// Small objects come from the slab pages
+		thread_cache * cache = get_thread_cache();
+		size_t size_class = slab_class_of[(requested_size + 15) / 16];
+
+		if ( cache->objects[size_class] == NULL )
+			slab_refill(cache, size_class);
+
+		void * object = cache->objects[size_class];
+
+		if ( object == NULL ) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		cache->objects[size_class] = *(void**) object;
+		cache->object_count[size_class]--;
+
+		return object;
+	}
+
+	if ( requested_size > MAXIMUM_BLOCK_SIZE / 2 ) {
+		// This would take a whole arena, or more.
+		return large_chunk_malloc(requested_size, LARGE_CHUNK_HEADER);
+	}
+
+	if ( requested_size > EXTENT_MINIMUM ) {
+		pthread_mutex_lock(&heap_lock);
+		void * extent = extent_allocate(requested_size, NULL);
+		pthread_mutex_unlock(&heap_lock);
+
+		if ( extent == NULL )
+			errno = ENOMEM;
+
+		return extent;
+	}
+
+	return block_allocate(map_size_to_order(requested_size));
+}
+
+/*
+* Takes a buddy block of the given order, from the cache of the
+* thread if it is small.
+*/
+static void * block_allocate(size_t order)
+{
+	void * block;
+
+	if ( order < TCACHE_ORDERS ) {
+		// Small blocks are taken from the cache of this thread
+		thread_cache * cache = get_thread_cache();
+
+		if ( cache->blocks[order] == NULL )
+			thread_cache_refill(cache, order);
+
+		block = cache->blocks[order];
+
+		if ( block != NULL ) {
+			cache->blocks[order] = *(void**) block;
+			cache->count[order]--;
+		}
+	} else {
+		pthread_mutex_lock(&heap_lock);
+		block = buddy_allocate(order, NULL);
+		pthread_mutex_unlock(&heap_lock);
+	}
+
+	if ( block == NULL ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return block;
+}
+
+/*
+* As allocate(), for memory that reads as zeroes. Large chunks are
+* new mappings and need no clearing, nor do buddy blocks that were
+* cleared by the system and not written since. The small sizes are
+* cleared as they come out of the caches.
+*/
+static void * zeroed_allocate(size_t size)
+{
+	if ( size > MAXIMUM_BLOCK_SIZE / 2 )
+		return large_chunk_malloc(size, LARGE_CHUNK_HEADER);
+
+	size_t order = map_size_to_order(size);
+	void * block;
+	int zeroed;
+
+	if ( size <= MAXIMUM_SLAB_SIZE || order < TCACHE_ORDERS ) {
+		block = allocate(size);
+
+		if ( block != NULL )
+			memset(block, 0, size);
+
+		return block;
+	}
+
+	pthread_mutex_lock(&heap_lock);
+
+	if ( size > EXTENT_MINIMUM )
+		block = extent_allocate(size, &zeroed);
+	else
+		block = buddy_allocate(order, &zeroed);
+
+	pthread_mutex_unlock(&heap_lock);
+
+	if ( block == NULL ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// Of a cleared block only the free list links are left
+	memset(block, 0, zeroed ? sizeof(meta_info) : size);
+
+	return block;
+}
+
+static void release_large_chunk(region * r)
+{
+	pthread_mutex_lock(&heap_lock);
+	heap_size -= r->length;
+	pthread_mutex_unlock(&heap_lock);
+
+	munmap(r, r->length);
+}
+
+static void release_object(void * ptr, size_t size_class)
+{
+	thread_cache * cache = get_thread_cache();
+
+	if ( number_of_nodes > 1 ) {
+		slab_page * page = (slab_page*) ((uintptr_t) ptr & ~(SLAB_PAGE_SIZE - 1));
+
+		if ( page->node != cache->node ) {
+			region * arena = region_of(ptr);
+
+			// Back to the page on its own node, not to this cache
+			if ( reserve_remote(arena->node, 1) ) {
+				push_remote(arena, ptr, ptr);
+				return;
+			}
+
+			slab_class * class = &slab_classes[page->node][size_class];
+
+			pthread_mutex_lock(&class->lock);
+			slab_free_object(class, ptr);
+			pthread_mutex_unlock(&class->lock);
+			return;
+		}
+	}
+
+	*(void**) ptr = cache->objects[size_class];
+	cache->objects[size_class] = ptr;
+	cache->object_count[size_class]++;
+
+	if ( cache->object_count[size_class] > TCACHE_CAPACITY ) {
+		// See REMOTE_CAPACITY
+		size_t left = spill_to_remote(&cache->objects[size_class], &cache->object_count[size_class], TCACHE_BATCH);
+
+		if ( left > 0 )
+			slab_drain(cache, size_class, left);
+	}
+}
+
+static void release_block(void * ptr, size_t order)
+{
+	region * arena = region_of(ptr);
+
+	if ( order < TCACHE_ORDERS ) {
+		// The block stays allocated as far as the buddy system
+		// knows, it is only put in the cache of this thread.
+		thread_cache * cache = get_thread_cache();
+
+		if ( number_of_nodes > 1 && arena->node != cache->node ) {
+			// A block of another node goes back to that node
+			if ( reserve_remote(arena->node, 1) ) {
+				push_remote(arena, ptr, ptr);
+				return;
+			}
+
+			pthread_mutex_lock(&heap_lock);
+			buddy_release(ptr);
+			pthread_mutex_unlock(&heap_lock);
+			return;
+		}
+
+		*(void**) ptr = cache->blocks[order];
+		cache->blocks[order] = ptr;
+		cache->count[order]++;
+
+		if ( cache->count[order] > TCACHE_CAPACITY ) {
+			size_t left = spill_to_remote(&cache->blocks[order], &cache->count[order], TCACHE_BATCH);
+
+			if ( left > 0 )
+				thread_cache_drain(cache, order, left);
+		}
+
+		return;
+	}
+
+	// See REMOTE_CAPACITY
+	release_orphaned_remote_frees();
+
+	pthread_mutex_lock(&heap_lock);
+
+	if ( order < DEFERRED_ORDERS ) {
+		// Left unmerged, see DEFERRED_ORDERS
+		*(void**) ptr = deferred_blocks[arena->node][order];
+		deferred_blocks[arena->node][order] = ptr;
+		deferred_count[arena->node][order]++;
+		arena->blocks_deferred++;
+
+		if ( arena->blocks_deferred == arena->blocks_in_use )
+			merge_deferred_in(arena);
+		else if ( deferred_count[arena->node][order] > DEFERRED_CAPACITY )
+			merge_deferred(arena->node, order, DEFERRED_BATCH);
+	} else {
+		buddy_release(ptr);
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+static void release(void * ptr)
+{
+	if ( ptr == NULL )
+		return;
+
+	region * r = region_of(ptr);
+
+	if ( r->kind == LARGE_CHUNK_REGION ) {
+		release_large_chunk(r);
+		return;
+	}
+
+	slab_page * page = slab_page_of(ptr);
+
+	if ( page != NULL ) {
+		release_object(ptr, page->size_class);
+		return;
+	}
+
+	unsigned char state = *block_state(ptr);
+
+	if ( state & BLOCK_CONTINUED ) {
+		pthread_mutex_lock(&heap_lock);
+		extent_release(ptr);
+		pthread_mutex_unlock(&heap_lock);
+		return;
+	}
+
+	release_block(ptr, state & BLOCK_ORDER_MASK);
+}
+
+/*
+* As release(), for a block of 'size' requested bytes. The size tells
+* which kind of block it is and of what class or order, so neither
+* the region nor the block table is looked at.
+*/
+static void release_sized(void * ptr, size_t size)
+{
+	if ( size <= MAXIMUM_SLAB_SIZE )
+		release_object(ptr, slab_class_of[(size + 15) / 16]);
+	else if ( size > MAXIMUM_BLOCK_SIZE / 2 )
+		release_large_chunk(region_of(ptr));
+	else if ( size > EXTENT_MINIMUM )
+		release(ptr); // one block or an extent
+	else
+		release_block(ptr, map_size_to_order(size));
+}
+
+/*
+* Returns 'size' bytes aligned to 'alignment', a power of two. Small
+* requests aligned to at most a cache line come from the slab classes
+* that are multiples of CACHELINE_SIZE. Everything else takes a buddy
+* block at least as large as the alignment, blocks being aligned to
+* their own size, or a large chunk with the payload at the alignment.
+*/
+static void * aligned_allocate(size_t alignment, size_t size)
+{
+	if ( alignment <= ALIGNMENT_SIZE_FOR_MALLOC )
+		return allocate(size);
+
+	if ( alignment > MAXIMUM_BLOCK_SIZE / 2 ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if ( alignment <= CACHELINE_SIZE && size <= MAXIMUM_SLAB_SIZE )
+		return allocate(size == 0 ? CACHELINE_SIZE : (size + CACHELINE_SIZE - 1) & ~(size_t) (CACHELINE_SIZE - 1));
+
+	if ( size > MAXIMUM_BLOCK_SIZE / 2 )
+		return large_chunk_malloc(size, alignment < LARGE_CHUNK_HEADER ? LARGE_CHUNK_HEADER : alignment);
+
+	return block_allocate(map_size_to_order(size < alignment ? alignment : size));
+}
+
+static int is_power_of_two(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size)
+{
+	if ( !is_power_of_two(alignment) || alignment % sizeof(void*) != 0 )
+		return EINVAL;
+
+	void * result = checks_on() ? arm(aligned_allocate(alignment, with_canary(size))) : aligned_allocate(alignment, size);
+
+	record_call(MALLOC_TRACE_MEMALIGN, (void*) alignment, size, result);
+
+	if ( result == NULL )
+		return ENOMEM;
+
+	*memptr = result;
+	return 0;
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+	if ( !is_power_of_two(alignment) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void * result = checks_on() ? arm(aligned_allocate(alignment, with_canary(size))) : aligned_allocate(alignment, size);
+
+	record_call(MALLOC_TRACE_MEMALIGN, (void*) alignment, size, result);
+	return result;
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+	return aligned_alloc(alignment, size);
+}
+
+void * valloc(size_t size)
+{
+	return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void * malloc(size_t size)
+{
+	void * result = checks_on() ? arm(allocate(with_canary(size))) : allocate(size);
+
+	record_call(MALLOC_TRACE_MALLOC, NULL, size, result);
+	return result;
+}
+
+void free(void * ptr)
+{
+	if ( ptr == NULL )
+		return;
+
+	// Recorded first, the block may be handed out again right away
+	record_call(MALLOC_TRACE_FREE, ptr, 0, NULL);
+
+	if ( checking ) {
+		checked_release(ptr, check_block("free", ptr));
+		return;
+	}
+
+	release(ptr);
+}
+
+/*
+* When checking the size must fit the block, but it is not
+* trusted to tell where the block came from.
+*/
+void free_sized(void * ptr, size_t size)
+{
+	if ( ptr == NULL )
+		return;
+
+	record_call(MALLOC_TRACE_FREE, ptr, 0, NULL);
+
+	if ( checking ) {
+		size_t payload = check_block("free_sized", ptr);
+
+		if ( with_canary(size) > payload )
+			report("free_sized", ptr, "wrong size");
+
+		checked_release(ptr, payload);
+		return;
+	}
+
+	release_sized(ptr, size);
+}
+
+size_t malloc_usable_size(void * ptr)
+{
+	if ( ptr == NULL )
+		return 0;
+
+	return payload_size(ptr) - canary_size;
+}
+
+/*
+* A malloc_arena hands out memory by moving a pointer up through
+* chunks taken with malloc, and gives it all back at once. The arena
+* itself sits at the start of its first chunk. A request of more than
+* a quarter of a chunk gets a chunk of its own, and the current one
+* goes on being used.
+*/
+#define DEFAULT_ARENA_CHUNK_SIZE	(64 << 10)
+
+typedef struct arena_chunk {
+	struct arena_chunk * next;
+	size_t unused; // keeps what follows aligned
+} arena_chunk;
+
+struct malloc_arena {
+	arena_chunk * chunks; // all but the first, the newest first
+	char * top; // of what was handed out of the current chunk
+	char * end; // of the current chunk
+	size_t chunk_size;
+};
+
+malloc_arena * arena_create(size_t chunk_size)
+{
+	if ( chunk_size == 0 )
+		chunk_size = DEFAULT_ARENA_CHUNK_SIZE;
+
+	if ( chunk_size < 4 * sizeof(malloc_arena) )
+		chunk_size = 4 * sizeof(malloc_arena);
+
+	malloc_arena * arena = malloc(chunk_size);
+
+	if ( arena == NULL )
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->top = (char*) (arena + 1);
+	arena->end = (char*) arena + chunk_size;
+	arena->chunk_size = chunk_size;
+
+	return arena;
+}
+
+// Takes a new chunk for a request that does not fit in the current one
+static void * arena_grow(malloc_arena * arena, size_t size)
+{
+	int own_chunk = size > arena->chunk_size / 4;
+	arena_chunk * chunk = malloc(own_chunk ? sizeof(arena_chunk) + size : arena->chunk_size);
+
+	if ( chunk == NULL )
+		return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	if ( !own_chunk ) {
+		arena->top = (char*) (chunk + 1) + size;
+		arena->end = (char*) chunk + arena->chunk_size;
+	}
+
+	return chunk + 1;
+}
+
+void * arena_alloc(malloc_arena * arena, size_t size)
+{
+	if ( size > SIZE_MAX - ALIGNMENT_SIZE_FOR_MALLOC - sizeof(arena_chunk) ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size = size == 0 ? ALIGNMENT_SIZE_FOR_MALLOC : (size + ALIGNMENT_SIZE_FOR_MALLOC - 1) & ~((size_t) ALIGNMENT_SIZE_FOR_MALLOC - 1);
+
+	if ( size > (size_t) (arena->end - arena->top) )
+		return arena_grow(arena, size);
+
+	void * ptr = arena->top;
+	arena->top += size;
+
+	return ptr;
+}
+
+void arena_reset(malloc_arena * arena)
+{
+	while ( arena->chunks != NULL ) {
+		arena_chunk * chunk = arena->chunks;
+
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	arena->top = (char*) (arena + 1);
+	arena->end = (char*) arena + arena->chunk_size;
+}
+
+void arena_destroy(malloc_arena * arena)
+{
+	if ( arena == NULL )
+		return;
+
+	arena_reset(arena);
+	free(arena);
+}
+
+/*
+* Returns the index in the histogram of requests for 'size',
+* the number of significant bits of it.
+*/
+static size_t request_bucket(size_t size)
+{
+	size_t bucket = size == 0 ? 0 : sizeof(unsigned long) * 8 - __builtin_clzl(size);
+
+	if ( bucket >= MALLOC_REQUEST_HISTOGRAM_SIZE )
+		bucket = MALLOC_REQUEST_HISTOGRAM_SIZE - 1;
+
+	return bucket;
+}
+
+/*
+* Writes out the records in the trace buffer.
+* The trace lock must be held.
+*/
+static void trace_flush()
+{
+	char * data = (char*) trace_buffer;
+	size_t left = trace_length * sizeof(malloc_trace_record);
+
+	while ( left > 0 ) {
+		ssize_t written = write(trace_fd, data, left);
+
+		if ( written <= 0 )
+			break;
+
+		data += written;
+		left -= written;
+	}
+
+	trace_length = 0;
+}
+
+static void record_call(uint32_t operation, void * pointer, size_t size, void * result)
+{
+	thread_cache * cache = get_thread_cache();
+
+	cache->calls[operation]++;
+
+	if ( operation != MALLOC_TRACE_FREE )
+		cache->requests[request_bucket(size)]++;
+
+	if ( validate_interval != 0 && __sync_add_and_fetch(&calls_since_validation, 1) % validate_interval == 0 )
+		malloc_check_heap();
+
+	if ( heap_map_requested && __sync_bool_compare_and_swap(&heap_map_requested, 1, 0) )
+		malloc_dump_heap(heap_map_fd);
+
+	if ( trace_fd < 0 )
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+
+	malloc_trace_record * record = &trace_buffer[trace_length++];
+
+	record->operation = operation;
+	record->thread = cache->number;
+	record->pointer = (uintptr_t) pointer;
+	record->size = size;
+	record->result = (uintptr_t) result;
+
+	if ( trace_length == TRACE_BUFFER_RECORDS )
+		trace_flush();
+
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void at_exit()
+{
+	if ( trace_fd >= 0 ) {
+		pthread_mutex_lock(&trace_lock);
+		trace_flush();
+		pthread_mutex_unlock(&trace_lock);
+	}
+
+	if ( print_statistics_at_exit )
+		malloc_print_statistics(STDERR_FILENO);
+
+	if ( heap_map_fd >= 0 )
+		malloc_dump_heap(heap_map_fd);
+}
+
+/*
+* The call counts of running threads are read without
+* stopping them, they may be a few calls behind.
+*/
+void malloc_get_statistics(malloc_statistics * statistics)
+{
+	size_t order, i;
+
+	memset(statistics, 0, sizeof(*statistics));
+
+	pthread_mutex_lock(&heap_lock);
+
+	statistics->heap_size = heap_size;
+	statistics->peak_heap_size = peak_heap_size;
+	statistics->splits = splits;
+	statistics->merges = merges;
+	statistics->number_of_classes = NUMBER_OF_LEVELS;
+
+	for ( order = 0; order < NUMBER_OF_LEVELS; order++ ) {
+		meta_info * walk;
+		size_t node;
+
+		statistics->class_size[order] = block_sizes[order];
+
+		for ( node = 0; node < number_of_nodes; node++ ) {
+			for ( walk = free_lists[node][order]; walk != NULL; walk = walk->succ )
+				statistics->free_bytes[order] += block_sizes[order];
+
+			if ( order < DEFERRED_ORDERS )
+				statistics->free_bytes[order] += deferred_count[node][order] * block_sizes[order];
+		}
+
+		statistics->bytes_free += statistics->free_bytes[order];
+
+		if ( statistics->free_bytes[order] > 0 )
+			statistics->largest_free_block = block_sizes[order];
+	}
+
+	for ( i = 0; i < NUMBER_OF_CALLS; i++ )
+		statistics->calls[i] = exited_calls[i];
+
+	for ( i = 0; i < MALLOC_REQUEST_HISTOGRAM_SIZE; i++ )
+		statistics->requests[i] = exited_requests[i];
+
+	thread_cache * cache;
+
+	for ( cache = thread_caches; cache != NULL; cache = cache->next ) {
+		for ( i = 0; i < NUMBER_OF_CALLS; i++ )
+			statistics->calls[i] += cache->calls[i];
+
+		for ( i = 0; i < MALLOC_REQUEST_HISTOGRAM_SIZE; i++ )
+			statistics->requests[i] += cache->requests[i];
+	}
+
+	pthread_mutex_unlock(&heap_lock);
+
+	statistics->bytes_in_use = statistics->heap_size - statistics->bytes_free;
+
+	if ( statistics->bytes_free > 0 )
+		statistics->fragmentation = 1.0 - (double) statistics->largest_free_block / statistics->bytes_free;
+}
+
+/*
+* Formats into a buffer on the stack and writes it,
+* so printing does not allocate.
+*/
+static void print_line(int fd, const char * format, ...)
+{
+	char line[128];
+	va_list arguments;
+
+	va_start(arguments, format);
+	int length = vsnprintf(line, sizeof(line), format, arguments);
+	va_end(arguments);
+
+	if ( length > 0 )
+		write(fd, line, length < (int) sizeof(line) ? length : (int) sizeof(line) - 1);
+}
+
+void malloc_print_statistics(int fd)
+{
+	malloc_statistics statistics;
+	size_t i;
+
+	malloc_get_statistics(&statistics);
+
+	print_line(fd, "nodes              %12zu\n", number_of_nodes);
+	print_line(fd, "heap size          %12zu\n", statistics.heap_size);
+	print_line(fd, "peak heap size     %12zu\n", statistics.peak_heap_size);
+	print_line(fd, "bytes in use       %12zu\n", statistics.bytes_in_use);
+	print_line(fd, "bytes free         %12zu\n", statistics.bytes_free);
+	print_line(fd, "largest free block %12zu\n", statistics.largest_free_block);
+	print_line(fd, "fragmentation      %12.3f\n", statistics.fragmentation);
+	print_line(fd, "splits             %12zu\n", statistics.splits);
+	print_line(fd, "merges             %12zu\n", statistics.merges);
+	print_line(fd, "calls              malloc %zu calloc %zu realloc %zu memalign %zu free %zu\n",
+		statistics.calls[MALLOC_TRACE_MALLOC], statistics.calls[MALLOC_TRACE_CALLOC],
+		statistics.calls[MALLOC_TRACE_REALLOC], statistics.calls[MALLOC_TRACE_MEMALIGN],
+		statistics.calls[MALLOC_TRACE_FREE]);
+
+	print_line(fd, "free bytes per order\n");
+
+	for ( i = 0; i < statistics.number_of_classes; i++ )
+		if ( statistics.free_bytes[i] > 0 )
+			print_line(fd, "  %12zu %12zu\n", statistics.class_size[i], statistics.free_bytes[i]);
+
+	print_line(fd, "requests by size\n");
+
+	for ( i = 0; i < MALLOC_REQUEST_HISTOGRAM_SIZE; i++ )
+		if ( statistics.requests[i] > 0 )
+			print_line(fd, "  < 2^%-7zu %12zu\n", i, statistics.requests[i]);
+}
 
-} 
 
 
 /*void print_all_free_blocks(){
@@ -335,7 +2848,7 @@ void free(void * ptr)
 
 			while ( walk != NULL )
 			{
-				printf("[%d] order %zu free: %d\n", walk, walk->order, walk->free);
+				printf("[%p] order %zu\n", walk, order);
 				walk = walk->succ;
 			}
 
@@ -347,7 +2860,6 @@ void free(void * ptr)
 int main(int argc, char * argv[])
 {
 
-//	buddy_system_init();
 //	print_all_free_blocks();
 	char * msg = malloc(1000);
 	if ( msg == NULL ){
@@ -1,9 +1,130 @@
 #ifndef OUR_MALLOC_H
 #define OUR_MALLOC_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 void * malloc(size_t);
 void * calloc(size_t , size_t);
 void free(void *);
 void * realloc(void*, size_t);
 
+/*
+* Aligned allocation, the alignment is a power of two. Everything
+* malloc returns is aligned to 16 bytes, and aligned_alloc(64, size)
+* gives cache line aligned memory.
+*/
+int posix_memalign(void **, size_t, size_t);
+void * aligned_alloc(size_t, size_t);
+void * memalign(size_t, size_t);
+void * valloc(size_t);
+
+// Number of bytes that can be stored at ptr, at least what was asked for
+size_t malloc_usable_size(void *);
+
+/*
+* As free(), with the size that was given to malloc, calloc (count *
+* size) or realloc for the block. Not for aligned allocations.
+*/
+void free_sized(void *, size_t);
+
+/*
+* Memory for objects that are all freed together. arena_alloc() hands
+* out memory aligned as malloc's does by moving a pointer through
+* chunks of 'chunk_size' bytes taken with malloc (0 for 64 KB).
+* arena_reset() frees everything allocated from the arena at once,
+* arena_destroy() the arena as well. What comes from an arena is never
+* passed to free or realloc. An arena is for one thread at a time.
+*/
+typedef struct malloc_arena malloc_arena;
+
+malloc_arena * arena_create(size_t chunk_size);
+void * arena_alloc(malloc_arena *, size_t);
+void arena_reset(malloc_arena *);
+void arena_destroy(malloc_arena *);
+
+// Number of reallocs that resized the block without copying
+size_t realloc_in_place_count();
+
+/*
+* Checks the whole heap for corruption and aborts with a message on
+* stderr if it finds any. With OUR_MALLOC_CHECK set every block also
+* carries a canary that free checks, see the allocator for the rest.
+*/
+void malloc_check_heap();
+
+/*
+* Writes a map of the heap to a file descriptor: a record that starts
+* the map, then one per region of the heap, each followed by one per
+* block in it in address order. With OUR_MALLOC_HEAP_MAP=<file> a map
+* is appended to the file at exit and on the first call after the
+* process gets SIGUSR2. heap_map.c renders them.
+*/
+#define MALLOC_HEAP_MAP_START		0 // order is the allocator, size the heap size
+#define MALLOC_HEAP_MAP_REGION		1 // an arena or the heap, offset is its address
+#define MALLOC_HEAP_MAP_FREE		2
+#define MALLOC_HEAP_MAP_USED		3
+#define MALLOC_HEAP_MAP_SLAB		4 // a page of small objects
+
+#define MALLOC_HEAP_MAP_BUDDY		1
+#define MALLOC_HEAP_MAP_LIST		2
+
+typedef struct malloc_heap_map_record {
+	uint32_t kind;
+	uint32_t order; // of a buddy block, bin of a list block, node of an arena
+	uint64_t offset; // of a block from the start of its region
+	uint64_t size;
+} malloc_heap_map_record;
+
+void malloc_dump_heap(int fd);
+
+/*
+* Statistics of the allocator, filled in by malloc_get_statistics().
+* bytes_in_use is everything taken from the system that is not in
+* a free list, bookkeeping included.
+*/
+#define MALLOC_STATISTICS_CLASSES	128
+#define MALLOC_NUMBER_OF_CALLS		5
+#define MALLOC_REQUEST_HISTOGRAM_SIZE	48
+
+typedef struct malloc_statistics {
+	size_t heap_size; // bytes taken from the system
+	size_t peak_heap_size;
+	size_t bytes_in_use;
+	size_t bytes_free;
+	size_t largest_free_block;
+	double fragmentation; // 1 - largest_free_block / bytes_free
+	size_t splits; // free blocks cut in two
+	size_t merges; // free blocks joined with a neighbour
+	size_t number_of_classes; // entries used in the two arrays below
+	size_t class_size[MALLOC_STATISTICS_CLASSES]; // smallest block of each order or bin
+	size_t free_bytes[MALLOC_STATISTICS_CLASSES]; // bytes free in each order or bin
+	size_t calls[MALLOC_NUMBER_OF_CALLS]; // indexed by MALLOC_TRACE_MALLOC and friends
+	size_t requests[MALLOC_REQUEST_HISTOGRAM_SIZE]; // requests[i] counts the sizes below 2^i and at least 2^(i-1)
+} malloc_statistics;
+
+void malloc_get_statistics(malloc_statistics *);
+
+// Writes the statistics in text form to a file descriptor
+void malloc_print_statistics(int fd);
+
+/*
+* With OUR_MALLOC_STATS set in the environment the statistics are
+* written to stderr at exit. With OUR_MALLOC_TRACE=<file> every call
+* is appended to the file as one of these records.
+*/
+#define MALLOC_TRACE_MALLOC		0
+#define MALLOC_TRACE_FREE		1
+#define MALLOC_TRACE_CALLOC		2
+#define MALLOC_TRACE_REALLOC		3
+#define MALLOC_TRACE_MEMALIGN		4 // the alignment is in 'pointer'
+
+typedef struct malloc_trace_record {
+	uint32_t operation;
+	uint32_t thread;
+	uint64_t pointer; // argument of free and realloc
+	uint64_t size; // requested size, count * size for calloc
+	uint64_t result; // pointer returned
+} malloc_trace_record;
+
 #endif 
\ No newline at end of file
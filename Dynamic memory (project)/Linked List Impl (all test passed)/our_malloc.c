@@ -1,6 +1,5 @@
 #include <unistd.h>
 #include <stdio.h>
-//#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -8,9 +7,18 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <stdarg.h>
+
+#ifdef __linux__
+#include <sys/auxv.h>
+#endif
 
 #include "our_malloc.h"
+#include "../page_source.h"
 
 //#define DEBUG_ALIGNMENT_OUR_MALLOC
 //#define DEBUG_OUR_MALLOC
@@ -18,17 +26,84 @@
 
 //#define WRITE_LIFTED
 
+/*
+* Every block starts with this header. The size is that of the whole
+* block, header included, and since it is a multiple of the alignment
+* the lowest bits are free to hold the flags below.
+*
+* A free block also ends with a copy of its size (the footer), so the
+* block after it can find it by address arithmetic. Allocated blocks
+* have no footer, their payload runs to the end of the block.
+*/
 typedef struct meta_info {
 	size_t size;
-	int free;
-	struct meta_info * next;
-	struct meta_info * prev;
+} meta_info;
 
-	//int magic_number;
+/*
+* Blocks start 8 bytes past a multiple of the alignment and their
+* sizes are multiples of it, so every payload is aligned.
+*/
+#define ALIGNMENT_SIZE_FOR_MALLOC	16
 
-} meta_info;
+#define BLOCK_FREE			1
+#define PREV_BLOCK_FREE			2
+
+// An allocated block over memory somebody else took from the page source
+#define FOREIGN_BLOCK			4
+
+#define BLOCK_SIZE(block)		((block)->size & ~((size_t) ALIGNMENT_SIZE_FOR_MALLOC - 1))
+#define NEXT_BLOCK(block)		((meta_info*) ((char*)(block) + BLOCK_SIZE(block)))
+#define FOOTER(block, size)		((size_t*) ((char*)(block) + (size)) - 1)
+
+/*
+* A free block is also kept in the bin for its size. The links of
+* the bin are stored in the payload of the free block, so every
+* block needs room for them and for the footer.
+*/
+typedef struct free_links {
+	meta_info * next_free;
+	meta_info * prev_free;
+} free_links;
+
+#define FREE_LINKS(block)		((free_links*) ((void*)(block) + sizeof(meta_info)))
+
+#define MINIMUM_BLOCK_SIZE		(sizeof(meta_info) + sizeof(free_links) + sizeof(size_t))
+
+/*
+* Sizes below SMALL_BIN_LIMIT have a bin each (one per multiple of
+* the alignment), all blocks in such a bin have the same size.
+* Larger sizes share one bin per power of two.
+*/
+#define NUMBER_OF_SMALL_BINS		64
+#define SMALL_BIN_LIMIT			(NUMBER_OF_SMALL_BINS * ALIGNMENT_SIZE_FOR_MALLOC)
+#define SMALL_BIN_LIMIT_LOG2		10
+#define NUMBER_OF_LARGE_BINS		64
+#define NUMBER_OF_BINS			(NUMBER_OF_SMALL_BINS + NUMBER_OF_LARGE_BINS)
+
+static meta_info * bins[NUMBER_OF_BINS];
+
+// One bit per bin, set when the bin is not empty
+static uint64_t bin_map[NUMBER_OF_BINS / 64];
+
+// Where the next-fit search of each bin starts, NULL for the head
+static meta_info * rovers[NUMBER_OF_BINS];
+
+/*
+* Free blocks of TREE_MINIMUM bytes and more are not kept in the bins
+* but in a splay tree ordered by size, then address. Its links take
+* the place of the bin links. The smallest block that fits, the lowest
+* of that size, is found in a search of the tree.
+*/
+#define TREE_MINIMUM			4096
 
-#define ALIGNMENT_SIZE_FOR_MALLOC	8
+typedef struct tree_links {
+	meta_info * left;
+	meta_info * right;
+} tree_links;
+
+#define TREE_LINKS(block)		((tree_links*) ((void*)(block) + sizeof(meta_info)))
+
+static meta_info * tree_root = NULL;
 
 #ifdef WRITE_LIFTED
 static void * start = 0;
@@ -38,387 +113,1639 @@ static void * start = 0;
 meta_info * global_base = NULL;
 
 /*
-* This function returns a pointer to a free block of memory
-* that is large enough for 'size'. And if it fails to find
-* one, 'last' is set to point to the uppermost block. 
+* The heap always ends with an allocated block of size zero.
+* Its PREV_BLOCK_FREE flag tells if the uppermost block is free.
 */
-static meta_info * find_next_free_block(meta_info ** last, size_t size){
+static meta_info * epilogue = NULL;
 
-	meta_info * walk = global_base;
+// Number of calls to realloc that did not have to copy
+static size_t reallocs_in_place = 0;
 
-	if ( walk == NULL ){
-		// there is no global base
-		return NULL;
-	}
+/*
+* A free block of at least trim_threshold bytes is given back to the
+* system: by lowering the break if it is the uppermost block, or else
+* by releasing the pages between its links and its footer. The
+* threshold is set with OUR_MALLOC_TRIM_THRESHOLD, to a page or more,
+* and 0 turns it off.
+*/
+#define DEFAULT_TRIM_THRESHOLD		(1 << 20)
+#define TRIM_PAGE_SIZE			4096
 
-	while ( walk != NULL ) {
-		*last = walk;
+static size_t trim_threshold = DEFAULT_TRIM_THRESHOLD;
 
-		if ( walk->size >= size && walk->free == 1 ) {
-//			*last = NULL; // last is only legit if this function returns NULL
-			return walk;
-		}
+/*
+* Set by grow_heap() to where the pages it has just taken from the
+* page source begin. Those are new and hold only zeroes, so calloc()
+* need not clear the block past this point.
+*/
+static char * fresh_memory = NULL;
 
-		walk = walk->next;
-	}
+/*
+* Statistics, and the trace of calls when OUR_MALLOC_TRACE is set.
+* The trace is written in batches of TRACE_BUFFER_RECORDS, and at exit.
+*/
+#define NUMBER_OF_CALLS			MALLOC_NUMBER_OF_CALLS
+#define TRACE_BUFFER_RECORDS		256
+
+static size_t peak_heap_size = 0;
+static size_t splits = 0;
+static size_t merges = 0;
+static size_t calls[NUMBER_OF_CALLS];
+static size_t requests[MALLOC_REQUEST_HISTOGRAM_SIZE];
+
+static int initialized = 0;
+static int trace_fd = -1;
+static int print_statistics_at_exit = 0;
+static malloc_trace_record trace_buffer[TRACE_BUFFER_RECORDS];
+static size_t trace_length = 0;
+
+/*
+* Maps of the heap, see malloc_dump_heap(). SIGUSR2 only raises
+* heap_map_requested, the map is written by the next call, when the
+* heap is not in the middle of a change.
+*/
+#define HEAP_MAP_BUFFER_RECORDS		256
+
+static int heap_map_fd = -1;
+static volatile sig_atomic_t heap_map_requested = 0;
+
+/*
+* Checks against heap corruption, on when OUR_MALLOC_CHECK is set.
+* Every block then ends in a canary word: a secret mixed with the
+* address of the payload and the size in the header. A write past the
+* payload or over the header shows when the block is freed. Freeing
+* inverts the canary, and the block must not be free already, so a
+* second free is caught.
+*
+* OUR_MALLOC_QUARANTINE=<bytes> keeps up to that many bytes of freed
+* blocks from being used again. They are filled with QUARANTINE_POISON,
+* which must be intact when they leave the quarantine, oldest first.
+* OUR_MALLOC_VALIDATE=<n> runs malloc_check_heap() every n calls.
+* Both turn the checks on as well. What is found is written to stderr
+* and the program aborted.
+*/
+#define QUARANTINE_POISON		0xfd
+#define QUARANTINE_SLOTS		1024
+
+static int checking = 0;
+static size_t canary_size = 0; // sizeof(uintptr_t) when checking
+static uintptr_t canary_secret;
+static size_t validate_interval = 0;
+static size_t calls_since_validation = 0;
+
+static void * quarantine[QUARANTINE_SLOTS]; // a ring, oldest at quarantine_head
+static size_t quarantine_head = 0;
+static size_t quarantine_length = 0;
+static size_t quarantine_bytes = 0;
+static size_t quarantine_limit = 0;
+
+static void * allocate(size_t);
+static void release(void *);
+static void record_call(uint32_t, void *, size_t, void *);
+static void print_line(int, const char *, ...);
+
+static size_t bin_index(size_t size)
+{
+	if ( size < SMALL_BIN_LIMIT )
+		return size / ALIGNMENT_SIZE_FOR_MALLOC;
 
-	return NULL; // now last is set to the uppermost block
+	size_t log2 = sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+	return NUMBER_OF_SMALL_BINS + log2 - SMALL_BIN_LIMIT_LOG2;
 }
 
-void free(void * ptr)
+/*
+* Orders the key (size, address) against a block of the tree:
+* below 0 if the key comes first, 0 if it is the block.
+*/
+static int tree_compare(size_t size, meta_info * address, meta_info * block)
 {
-	if ( ptr == NULL ) {
-		return;
-	}
+	if ( size != BLOCK_SIZE(block) )
+		return size < BLOCK_SIZE(block) ? -1 : 1;
 
-	// Undefined behavior warning: If ptr does not belong to the data
-	// previously allocated in 'malloc', the behavior is undefined. 
-	meta_info * block = (meta_info*) ((char*)ptr - sizeof(meta_info));
-	meta_info * next;
-	meta_info * prev;
+	if ( address != block )
+		return address < block ? -1 : 1;
 
-	block->free = 1;
+	return 0;
+}
 
-#ifdef DEBUG_OUR_MALLOC
-	//printf("free CALLED, size: %zu, magic_number: %d\n", block->size, block->magic_number);
-#endif
-	// check if merging is relevant.
-	next = block->next;
-	prev = block->prev;
+/*
+* Top-down splay: brings the block with the key, or the last block
+* met on the way to where it would be, to the root of the subtree.
+*/
+static meta_info * tree_splay(meta_info * root, size_t size, meta_info * address)
+{
+	struct {
+		meta_info header;
+		tree_links links;
+	} assembly;
+	meta_info * left = &assembly.header; // largest of the blocks below the key
+	meta_info * right = &assembly.header; // smallest of the blocks above it
+	meta_info * swap;
+
+	assembly.links.left = assembly.links.right = NULL;
+
+	for ( ;; ) {
+		int order = tree_compare(size, address, root);
+
+		if ( order < 0 ) {
+			if ( TREE_LINKS(root)->left == NULL )
+				break;
+
+			if ( tree_compare(size, address, TREE_LINKS(root)->left) < 0 ) {
+				// rotate right
+				swap = TREE_LINKS(root)->left;
+				TREE_LINKS(root)->left = TREE_LINKS(swap)->right;
+				TREE_LINKS(swap)->right = root;
+				root = swap;
+
+				if ( TREE_LINKS(root)->left == NULL )
+					break;
+			}
 
-	if ( next == NULL && prev == NULL ){
-		// Nothing to do at this point.
-		return;
-	} 
+			TREE_LINKS(right)->left = root;
+			right = root;
+			root = TREE_LINKS(root)->left;
+		} else if ( order > 0 ) {
+			if ( TREE_LINKS(root)->right == NULL )
+				break;
+
+			if ( tree_compare(size, address, TREE_LINKS(root)->right) > 0 ) {
+				// rotate left
+				swap = TREE_LINKS(root)->right;
+				TREE_LINKS(root)->right = TREE_LINKS(swap)->left;
+				TREE_LINKS(swap)->left = root;
+				root = swap;
+
+				if ( TREE_LINKS(root)->right == NULL )
+					break;
+			}
 
-	if ( next != NULL ) {
+			TREE_LINKS(left)->right = root;
+			left = root;
+			root = TREE_LINKS(root)->right;
+		} else {
+			break;
+		}
+	}
 
-		if ( next->free == 1 ) {
-			// merge!
-			block->size += next->size + sizeof(meta_info);
-			block->next = next->next;
+	TREE_LINKS(left)->right = TREE_LINKS(root)->left;
+	TREE_LINKS(right)->left = TREE_LINKS(root)->right;
+	TREE_LINKS(root)->left = assembly.links.right;
+	TREE_LINKS(root)->right = assembly.links.left;
 
-			if ( next->next != NULL )
-				next->next->prev = block;
+	return root;
+}
 
-		}
+static void tree_insert(meta_info * block)
+{
+	tree_links * links = TREE_LINKS(block);
 
+	if ( tree_root == NULL ) {
+		links->left = links->right = NULL;
+		tree_root = block;
+		return;
 	}
 
-	if ( prev != NULL ) {
+	tree_root = tree_splay(tree_root, BLOCK_SIZE(block), block);
+
+	if ( tree_compare(BLOCK_SIZE(block), block, tree_root) < 0 ) {
+		links->left = TREE_LINKS(tree_root)->left;
+		links->right = tree_root;
+		TREE_LINKS(tree_root)->left = NULL;
+	} else {
+		links->right = TREE_LINKS(tree_root)->right;
+		links->left = tree_root;
+		TREE_LINKS(tree_root)->right = NULL;
+	}
 
-		if ( prev->free == 1 ) {
-			// merge!
-			prev->size += block->size + sizeof(meta_info);
-			prev->next = block->next;
+	tree_root = block;
+}
 
-			if ( block->next != NULL ) 
-				block->next->prev = prev;
+static void tree_remove(meta_info * block)
+{
+	meta_info * root = tree_splay(tree_root, BLOCK_SIZE(block), block);
 
-		}
+	if ( TREE_LINKS(root)->left == NULL ) {
+		tree_root = TREE_LINKS(root)->right;
+		return;
 	}
 
+	// Everything on the left is below the key, so the largest of
+	// them comes up, with nothing on its right.
+	tree_root = tree_splay(TREE_LINKS(root)->left, BLOCK_SIZE(block), block);
+	TREE_LINKS(tree_root)->right = TREE_LINKS(root)->right;
 }
 
-static size_t align_this_size(size_t size) {
-	return ( size + ALIGNMENT_SIZE_FOR_MALLOC - 1 ) & ~(ALIGNMENT_SIZE_FOR_MALLOC - 1);
+// The smallest block of at least 'size' bytes, the lowest of that size
+static meta_info * tree_best_fit(size_t size)
+{
+	if ( tree_root == NULL )
+		return NULL;
+
+	tree_root = tree_splay(tree_root, size, NULL);
+
+	if ( BLOCK_SIZE(tree_root) >= size )
+		return tree_root;
+
+	// The root is the largest block below the key, its successor fits
+	meta_info * walk = TREE_LINKS(tree_root)->right;
+
+	while ( walk != NULL && TREE_LINKS(walk)->left != NULL )
+		walk = TREE_LINKS(walk)->left;
+
+	return walk;
 }
 
-void * malloc(size_t size_requested)
+static void add_to_bin(meta_info * block)
 {
+	if ( BLOCK_SIZE(block) >= TREE_MINIMUM ) {
+		tree_insert(block);
+		return;
+	}
 
-#ifdef WRITE_LIFTED
+	size_t index = bin_index(BLOCK_SIZE(block));
+	free_links * links = FREE_LINKS(block);
 
-/*	struct rlimit values;
+	links->prev_free = NULL;
+	links->next_free = bins[index];
 
-	int status = getrlimit(RLIMIT_DATA, &values);
+	if ( bins[index] != NULL )
+		FREE_LINKS(bins[index])->prev_free = block;
 
-	fprintf(stderr, "status of getrlimit: %d\n", status);
+	bins[index] = block;
+	bin_map[index / 64] |= (uint64_t) 1 << (index % 64);
+}
 
-	if ( values.rlim_max == RLIM_INFINITY ) {
-		fprintf(stderr, "IT IS INFINITE...\n");
+static void remove_from_bin(meta_info * block)
+{
+	if ( BLOCK_SIZE(block) >= TREE_MINIMUM ) {
+		tree_remove(block);
+		return;
 	}
 
-	fprintf(stderr, "LIMITS soft (%u), max (%u)\n", values.rlim_cur, values.rlim_max); */
+	size_t index = bin_index(BLOCK_SIZE(block));
+	free_links * links = FREE_LINKS(block);
 
-	static int first_time = 1;
-	if ( first_time ) {
-		start = sbrk(0);
-		first_time = 0;
-	}
-#endif
+	if ( links->prev_free != NULL )
+		FREE_LINKS(links->prev_free)->next_free = links->next_free;
+	else
+		bins[index] = links->next_free;
 
-#ifdef DEBUG_OUR_MALLOC
-	static int count;
-#endif	
+	if ( links->next_free != NULL )
+		FREE_LINKS(links->next_free)->prev_free = links->prev_free;
 
-	size_t size = align_this_size(size_requested);
+	if ( rovers[index] == block )
+		rovers[index] = links->next_free;
 
-	if ( global_base == NULL ) {
-		// First time malloc is called
-		// Initialization: move the base of the heap to an aligned place
-		char * top_of_the_heap = sbrk(0);
-		//printf("initial break: %d\n", top_of_the_heap);
+	if ( bins[index] == NULL )
+		bin_map[index / 64] &= ~((uint64_t) 1 << (index % 64));
+}
 
-		intptr_t offset = ((intptr_t) top_of_the_heap) % ALIGNMENT_SIZE_FOR_MALLOC;
+/*
+* Turns 'block' into a free block of 'size' bytes: writes the header
+* and the footer, tells the next block about it and puts it in its bin.
+* The block before a free block is never free.
+*/
+static void make_free_block(meta_info * block, size_t size)
+{
+	block->size = size | BLOCK_FREE;
+	*FOOTER(block, size) = size;
 
-		if ( offset != 0 ) {
-			//printf("offset not zero.\n");
-			sbrk(ALIGNMENT_SIZE_FOR_MALLOC - offset);
-			//assert ( status != (void*) - 1);
-		}
+	NEXT_BLOCK(block)->size |= PREV_BLOCK_FREE;
 
-		//top_of_the_heap = sbrk(0);
+	add_to_bin(block);
+}
 
-		//assert( ((intptr_t) top_of_the_heap) % ALIGNMENT_SIZE_FOR_MALLOC == 0 );
-		// The top of the heap is fixed!
+/*
+* Returns the first non-empty bin with an index above 'index',
+* or NUMBER_OF_BINS if there is none.
+*/
+static size_t next_non_empty_bin(size_t index)
+{
+	index++;
 
-		// Handling the malloc request
-		void * request = sbrk(sizeof(meta_info) + size);
+	while ( index < NUMBER_OF_BINS ) {
+		uint64_t word = bin_map[index / 64] >> (index % 64);
 
-		if ( (void*)request == (void*) -1 ) {
-			errno = ENOMEM;
-			return NULL;
-		}
+		if ( word != 0 )
+			return index + __builtin_ctzll(word);
 
+		index = (index / 64 + 1) * 64;
+	}
 
-/*#ifdef WRITE_TO_FILE
-		count += sizeof(meta_info) + size;
-		fprintf(debug_fp, "count: %llu\n", count);
-		fclose(debug_fp);
-#endif*/
+	return NUMBER_OF_BINS;
+}
 
-		// The global base is not set
-		// We will set it.
-		global_base = (meta_info*) request;
+/*
+* The placement policies. Each picks a block of at least 'size' bytes
+* from the large bin 'index', or returns NULL if there is none.
+*/
+static meta_info * first_fit(size_t index, size_t size)
+{
+	meta_info * walk = bins[index];
 
-#ifdef DEBUG_OUR_MALLOC
-		global_base->magic_number = count;
-#endif	
+	while ( walk != NULL && BLOCK_SIZE(walk) < size )
+		walk = FREE_LINKS(walk)->next_free;
 
-		global_base->next = NULL; // this marks the end of the list
-		global_base->prev = NULL; // this is unique for the base.
-		global_base->size = size;
-		global_base->free = 0;
+	return walk;
+}
 
-		return ((void*)global_base) + sizeof(meta_info);
+// Goes on from the block after the one last taken from the bin
+static meta_info * next_fit(size_t index, size_t size)
+{
+	meta_info * start = rovers[index] != NULL ? rovers[index] : bins[index];
+	meta_info * walk = start;
 
-	} 
+	while ( walk != NULL ) {
+		if ( BLOCK_SIZE(walk) >= size ) {
+			rovers[index] = FREE_LINKS(walk)->next_free;
+			return walk;
+		}
+
+		walk = FREE_LINKS(walk)->next_free;
 
-	// else: Global base exists. 
+		if ( walk == NULL )
+			walk = bins[index];
 
-	meta_info * next_free_block;
+		if ( walk == start )
+			break;
+	}
 
-	meta_info * last = NULL;
+	return NULL;
+}
 
-	next_free_block = find_next_free_block(&last, size);
+static meta_info * best_fit(size_t index, size_t size)
+{
+	meta_info * walk, * best = NULL;
 
-	if ( next_free_block == NULL ) {
-		// There was no free block
-		void * request = sbrk(size + sizeof(meta_info));
+	for ( walk = bins[index]; walk != NULL; walk = FREE_LINKS(walk)->next_free ) {
+		size_t have = BLOCK_SIZE(walk);
 
-#ifdef DEBUG_OUR_MALLOC
-		count++;
-#endif	
+		if ( have >= size && (best == NULL || have < BLOCK_SIZE(best)) ) {
+			best = walk;
 
-		// when testing, when running return NULL here instead. 
-		if ( request == (void*) -1 ) {
-			// there was an error, errno is set and null is returned.
-			errno = ENOMEM;
-			return NULL;
+			if ( have == size )
+				break;
 		}
+	}
 
-/*#ifdef WRITE_TO_FILE
-		count += sizeof(meta_info) + size;
-		fprintf(debug_fp, "count: %llu\n", count);
-		fclose(debug_fp);
-#endif*/
+	return best;
+}
 
-		// The request was successful!
-		// 'last' is now available for us to use
-		// since we iterated through the entire list in 'find_next_free_block'
-		meta_info * the_new_block = (meta_info*) request;
+// As best_fit(), the lowest of the blocks of the best size
+static meta_info * address_ordered_best_fit(size_t index, size_t size)
+{
+	meta_info * walk, * best = NULL;
 
-		the_new_block->next = NULL;
-		the_new_block->prev = last;
-		the_new_block->free = 0;
-		the_new_block->size = size;
+	for ( walk = bins[index]; walk != NULL; walk = FREE_LINKS(walk)->next_free ) {
+		size_t have = BLOCK_SIZE(walk);
 
-		last->next = the_new_block;
+		if ( have < size )
+			continue;
 
-#ifdef DEBUG_OUR_MALLOC
+		if ( best == NULL || have < BLOCK_SIZE(best) || (have == BLOCK_SIZE(best) && walk < best) )
+			best = walk;
+	}
 
-		the_new_block->magic_number = count;
+	return best;
+}
 
-#endif
+typedef struct placement_policy {
+	const char * name;
+	meta_info * (*search)(size_t index, size_t size);
+} placement_policy;
 
+static const placement_policy placement_policies[] = {
+	{ "first", first_fit },
+	{ "next", next_fit },
+	{ "best", best_fit },
+	{ "address", address_ordered_best_fit }
+};
 
-		////printf("%d\n", ((char*)request) + sizeof(meta_info));
-		return ((void*)the_new_block) + sizeof(meta_info);
+#define NUMBER_OF_PLACEMENT_POLICIES	(sizeof(placement_policies) / sizeof(placement_policies[0]))
 
-	} else {
-		// There exists a free block
+static const placement_policy * placement = &placement_policies[0];
 
-		// Check if we can squeez
-		if ( next_free_block->size > size + sizeof(meta_info) + 8 ) {
-			// The squeezed block should have at least 8 bytes of data.
-			meta_info * new_squeezed_block = ((void*)next_free_block) + sizeof(meta_info) + size;
+/*
+* The policy is picked with OUR_MALLOC_PLACEMENT when the heap is
+* set up: first (the default), next, best or address (best fit, the
+* lowest address among equals).
+*/
+static void choose_placement()
+{
+	char * name = getenv("OUR_MALLOC_PLACEMENT");
+	size_t i;
 
-			new_squeezed_block->size = next_free_block->size - sizeof(meta_info) - size;
-			new_squeezed_block->prev = next_free_block;
-			new_squeezed_block->next = next_free_block->next;
-			new_squeezed_block->free = 1;
+	for ( i = 0; name != NULL && i < NUMBER_OF_PLACEMENT_POLICIES; i++ )
+		if ( strcmp(name, placement_policies[i].name) == 0 )
+			placement = &placement_policies[i];
+}
 
-			if ( next_free_block->next != NULL ){
-				next_free_block->next->prev = new_squeezed_block;
-			}
+/*
+* This function returns a pointer to a free block of memory
+* that is large enough for 'size', or NULL if there is none.
+* Only the bin for 'size' may have to be searched, any block in
+* a bin above it is large enough, and then the tree. A small bin
+* holds one size only, so its first block is taken whatever the
+* policy. The tree always gives the best fit.
+*/
+static meta_info * find_next_free_block(size_t size){
 
-			next_free_block->next = new_squeezed_block;
+	if ( size >= TREE_MINIMUM )
+		return tree_best_fit(size);
 
-			next_free_block->size = size;
+	size_t index = bin_index(size);
+	meta_info * found = bins[index];
 
-		}
+	if ( index >= NUMBER_OF_SMALL_BINS )
+		found = placement->search(index, size);
 
+	if ( found != NULL )
+		return found;
 
-#ifdef DEBUG_OUR_MALLOC
-		//printf("MALLOC RETURNS OLD BLOCK, size: %zu, magic_number: %d\n",next_free_block->size, next_free_block->magic_number);
-#endif
+	index = next_non_empty_bin(index);
 
-		next_free_block->free = 0; // this one is no longer free.
+	if ( index == NUMBER_OF_BINS )
+		return tree_best_fit(size);
 
-		////printf("%d\n", ((char*)next_free_block) + sizeof(meta_info));
-		return (void*)next_free_block + sizeof(meta_info);
+	if ( index < NUMBER_OF_SMALL_BINS )
+		return bins[index];
+
+	return placement->search(index, size);
+}
 
+/*
+* Gives the free block of 'size' bytes at 'block' back to the system.
+* Returns 1 if the break was lowered and the block is gone, 0 if the
+* block is to be put in a bin; its pages are then released.
+*/
+static int trim(meta_info * block, size_t size)
+{
+	if ( (char*)block + size == (char*)epilogue && page_source_extend(0) == (char*)epilogue + sizeof(meta_info) ) {
+		// The block before a free block is never free, so
+		// the new epilogue has no flags.
+		epilogue = block;
+		epilogue->size = 0;
+		page_source_extend(-(intptr_t) size);
+		return 1;
 	}
 
-}
+	uintptr_t start = (uintptr_t) FREE_LINKS(block) + sizeof(free_links);
+	uintptr_t end = (uintptr_t) FOOTER(block, size);
 
-#ifdef DEBUG_OUR_MALLOC
-static void print_pointer_not_freed(){
-	meta_info * walk = global_base;
-	while ( walk != NULL ){
-		if ( walk->free == 0 ){
-			//printf("[%d]: %s", walk->magic_number, ((char*)walk) + sizeof(meta_info));
-		} else {
-			//printf("[%d] found free block here of size: %zu\n", walk->magic_number, walk->size);
-		}
+	start = (start + TRIM_PAGE_SIZE - 1) & ~((uintptr_t) TRIM_PAGE_SIZE - 1);
+	end &= ~((uintptr_t) TRIM_PAGE_SIZE - 1);
 
+	if ( start < end )
+		madvise((void*) start, end - start, MADV_DONTNEED);
 
-		walk = walk->next;
-	}
+	return 0;
 }
-#endif	
-
 
-void * calloc(size_t count, size_t size)
+static void release(void * ptr)
 {
+	if ( ptr == NULL ) {
+		return;
+	}
 
-#ifdef WRITE_LIFTED
-	setvbuf(stderr, NULL, _IONBF, 0);
-	fprintf(stderr, "lifted (so far): %d\n", sbrk(0) - start);
-#endif
+	// Undefined behavior warning: If ptr does not belong to the data
+	// previously allocated in 'malloc', the behavior is undefined. 
+	meta_info * block = (meta_info*) ((char*)ptr - sizeof(meta_info));
+	size_t size = BLOCK_SIZE(block);
+	meta_info * next = NEXT_BLOCK(block);
 
 #ifdef DEBUG_OUR_MALLOC
-	//printf("CALLOC CALLED\n");
+	//printf("free CALLED, size: %zu\n", size);
 #endif
+	// check if merging is relevant. The neighbours are found
+	// by address, the one below through its footer.
+	if ( next->size & BLOCK_FREE ) {
+		// merge!
+		remove_from_bin(next);
+		size += BLOCK_SIZE(next);
+		merges++;
+	}
 
-	size_t total = count * size;
-	size_t actual = align_this_size(total);
-	void * request = malloc(actual);
-
-	if ( request == NULL )
-		return NULL;
-
-	memset(request, 0, actual);
-	return request;
-}
-
-void * realloc(void* ptr, size_t size) {
+	if ( block->size & PREV_BLOCK_FREE ) {
+		// merge!
+		size_t prev_size = *FOOTER(block, 0);
+		meta_info * prev = (meta_info*) ((char*)block - prev_size);
 
-	if ( ptr == NULL ) {
-		// realloc(NULL, size) should be identical to malloc(size)
-		return malloc(size);
-	} else if ( size == 0 ) {
-		// If size is zero and ptr is not NULL, a new, minimum sized object is
-    	// allocated and the original object is freed.
-		free(ptr);
-		return malloc(100); // lets say 10 is our minimum size object.
+		remove_from_bin(prev);
+		size += prev_size;
+		block = prev;
+		merges++;
 	}
-	void * tmp = malloc(size);
-	if ( tmp != ptr )
-		memcpy(tmp, ptr, ((meta_info*)(ptr-sizeof(meta_info)))->size < size ? ((meta_info*)(ptr-sizeof(meta_info)))->size : size);
-	free(ptr);
 
+	if ( trim_threshold != 0 && size >= trim_threshold && trim(block, size) )
+		return;
 
+	make_free_block(block, size);
+}
 
-	return tmp;
+static size_t align_this_size(size_t size) {
+	return ( size + ALIGNMENT_SIZE_FOR_MALLOC - 1 ) & ~(ALIGNMENT_SIZE_FOR_MALLOC - 1);
 }
 
-void * realloc_old(void* ptr, size_t size){
-	meta_info * block;
-	size_t old_block_size;
+static size_t heap_size()
+{
+	if ( global_base == NULL )
+		return 0;
 
-#ifdef DEBUG_OUR_MALLOC
-	//printf("REALLOC CALLED\n");
-#endif
-	if ( ptr == NULL ) {
-		// realloc(NULL, size) should be identical to malloc(size)
-		return malloc(size);
-	} else if ( size == 0 ) {
-		// If size is zero and ptr is not NULL, a new, minimum sized object is
-    	// allocated and the original object is freed.
-		free(ptr);
-		return malloc(16); // lets say 10 is our minimum size object.
-	} 
+	return (char*)epilogue + sizeof(meta_info) - (char*)global_base;
+}
 
-	block = (meta_info*) ((char*)ptr - sizeof(meta_info)); // might be undefined, if used badly!
+static void count_heap_growth()
+{
+	if ( heap_size() > peak_heap_size )
+		peak_heap_size = heap_size();
+}
 
-	old_block_size = block->size;
+/*
+* Gets a block of 'size' bytes at the top of the heap from the page source. If the
+* uppermost block is free it is grown, otherwise a new block takes the
+* place of the epilogue. The block is returned allocated.
+*/
+static meta_info * grow_heap(size_t size)
+{
+	meta_info * last_free = NULL;
+	size_t have = 0;
 
-/*	if ( block->size >= size ) {
-		return ptr;
-	} else {
-		// We look at our neighbour upstais and see if its free
+	if ( epilogue->size & PREV_BLOCK_FREE ) {
+		have = *FOOTER(epilogue, 0);
+		last_free = (meta_info*) ((char*)epilogue - have);
+		remove_from_bin(last_free);
+	}
 
-		meta_info * upper_block = block->next;
+	char * request = page_source_extend(size - have);
 
-		if ( upper_block != NULL ) {
+	// when testing, when running return NULL here instead. 
+	if ( request == (void*) -1 ) {
+		// there was an error, errno is set and null is returned.
+		if ( last_free != NULL )
+			add_to_bin(last_free);
+		return NULL;
+	}
 
-			if ( upper_block->free == 1 && upper_block->size + block->size + sizeof(meta_info) > size ) {
+	meta_info * block = last_free != NULL ? last_free : epilogue;
 
-				block->next = block->next->next;
+	if ( request != (char*)epilogue + sizeof(meta_info) ) {
+		// Somebody else has moved the break. The old epilogue becomes
+		// an allocated block that spans the gap, and the new block
+		// starts in the memory just handed to us.
+		size_t padding = align_this_size((uintptr_t) request + sizeof(meta_info)) - sizeof(meta_info) - (uintptr_t) request;
 
-				if ( block->next->next != NULL )
-					block->next->next->prev = block;
+		if ( page_source_extend(padding + have + sizeof(meta_info)) == (void*) -1 ) {
+			if ( last_free != NULL )
+				add_to_bin(last_free);
+			return NULL;
+		}
 
-				return ptr;
-			}
+		block = (meta_info*) (request + padding);
+		epilogue->size = ((char*)block - (char*)epilogue) | (epilogue->size & PREV_BLOCK_FREE) | FOREIGN_BLOCK;
 
-		} 
+		if ( last_free != NULL )
+			add_to_bin(last_free);
+	}
 
-		// We found no help from our neighbour upstairs. We need to allocate and the memcpy.
+	// The page the old top was in may have been used before
+	fresh_memory = (char*) (((uintptr_t) request + TRIM_PAGE_SIZE - 1) & ~((uintptr_t) TRIM_PAGE_SIZE - 1));
 
-		void * new_data = malloc(size);
+	block->size = size;
 
-		memcpy(new_data, ptr, block->size);
+	epilogue = NEXT_BLOCK(block);
+	epilogue->size = 0;
 
-		free(ptr);
+	count_heap_growth();
 
-		return new_data;
-	}
-*/
+	return block;
+}
 
-	free(ptr);
-	void * new_mem = malloc(size);
+static void * allocate(size_t size_requested)
+{
 
-	if ( new_mem == NULL )
-		return NULL;
+#ifdef WRITE_LIFTED
 
-	if ( ptr != new_mem )
-		memcpy(new_mem, ptr, size < old_block_size ? size : old_block_size );
+/*	struct rlimit values;
 
-	return new_mem;
+	int status = getrlimit(RLIMIT_DATA, &values);
 
+	fprintf(stderr, "status of getrlimit: %d\n", status);
+
+	if ( values.rlim_max == RLIM_INFINITY ) {
+		fprintf(stderr, "IT IS INFINITE...\n");
+	}
+
+	fprintf(stderr, "LIMITS soft (%u), max (%u)\n", values.rlim_cur, values.rlim_max); */
+
+	static int first_time = 1;
+	if ( first_time ) {
+		start = page_source_extend(0);
+		first_time = 0;
+	}
+#endif
+
+	// The block holds the header and the payload, the footer is
+	// only needed once it is free.
+	size_t size = align_this_size(size_requested + sizeof(meta_info));
+
+	if ( size < size_requested ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	if ( size < MINIMUM_BLOCK_SIZE )
+		size = MINIMUM_BLOCK_SIZE;
+
+	if ( global_base == NULL ) {
+		// First time malloc is called
+		// Initialization: move the base of the heap to where the
+		// payload of a block would be aligned
+		char * top_of_the_heap = page_source_extend(0);
+		//printf("initial break: %d\n", top_of_the_heap);
+
+		intptr_t offset = ((intptr_t) top_of_the_heap + sizeof(meta_info)) % ALIGNMENT_SIZE_FOR_MALLOC;
+
+		if ( offset != 0 ) {
+			//printf("offset not zero.\n");
+			page_source_extend(ALIGNMENT_SIZE_FOR_MALLOC - offset);
+			//assert ( status != (void*) - 1);
+		}
+
+		// The heap starts out as just the epilogue
+		top_of_the_heap = page_source_extend(sizeof(meta_info));
+
+		if ( top_of_the_heap == (void*) -1 ) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		global_base = (meta_info*) top_of_the_heap;
+		epilogue = global_base;
+		epilogue->size = 0;
+
+		choose_placement();
+	} 
+
+	meta_info * next_free_block = find_next_free_block(size);
+
+	if ( next_free_block == NULL ) {
+		// There was no free block
+		meta_info * the_new_block = grow_heap(size);
+
+		if ( the_new_block == NULL ) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		return ((void*)the_new_block) + sizeof(meta_info);
+
+	} else {
+		// There exists a free block
+		size_t free_size = BLOCK_SIZE(next_free_block);
+
+		remove_from_bin(next_free_block);
+
+		// Check if we can squeez
+		if ( free_size >= size + MINIMUM_BLOCK_SIZE ) {
+			// The squeezed block should have room for its bin links and footer.
+			meta_info * new_squeezed_block = ((void*)next_free_block) + size;
+
+			next_free_block->size = size;
+			make_free_block(new_squeezed_block, free_size - size);
+			splits++;
+		} else {
+			// The whole block is used, the one after it is told so.
+			next_free_block->size = free_size;
+			NEXT_BLOCK(next_free_block)->size &= ~(size_t) PREV_BLOCK_FREE;
+		}
+
+
+#ifdef DEBUG_OUR_MALLOC
+		//printf("MALLOC RETURNS OLD BLOCK, size: %zu\n", BLOCK_SIZE(next_free_block));
+#endif
+
+		return (void*)next_free_block + sizeof(meta_info);
+
+	}
+
+}
+
+#ifdef DEBUG_OUR_MALLOC
+static void print_pointer_not_freed(){
+	meta_info * walk = global_base;
+	while ( walk != epilogue ){
+		if ( !(walk->size & BLOCK_FREE) ){
+			//printf("[%p]: %s", walk, ((char*)walk) + sizeof(meta_info));
+		} else {
+			//printf("[%p] found free block here of size: %zu\n", walk, BLOCK_SIZE(walk));
+		}
+
+
+		walk = NEXT_BLOCK(walk);
+	}
+}
+#endif	
+
+
+static void initialize();
+
+// Whether the checks are on, the environment is read on the first call
+static int checks_on()
+{
+	if ( !initialized )
+		initialize();
+
+	return checking;
+}
+
+// 'size' with room for the canary, SIZE_MAX if that does not fit
+static size_t with_canary(size_t size)
+{
+	return size + canary_size < size ? SIZE_MAX : size + canary_size;
+}
+
+static meta_info * block_of(void * ptr)
+{
+	return (meta_info*) ((char*)ptr - sizeof(meta_info));
+}
+
+static size_t usable_size(void * ptr)
+{
+	return BLOCK_SIZE(block_of(ptr)) - sizeof(meta_info) - canary_size;
+}
+
+// The canary is the last word of the block
+static uintptr_t * canary_of(void * ptr)
+{
+	meta_info * block = block_of(ptr);
+
+	return (uintptr_t*) ((char*)block + BLOCK_SIZE(block)) - 1;
+}
+
+static uintptr_t canary_value(void * ptr)
+{
+	return canary_secret ^ (uintptr_t) ptr ^ BLOCK_SIZE(block_of(ptr));
+}
+
+// Writes the canary of a block that is handed out, if checking
+static void * arm(void * ptr)
+{
+	if ( ptr != NULL && checking )
+		*canary_of(ptr) = canary_value(ptr);
+
+	return ptr;
+}
+
+static void report(const char * operation, void * ptr, const char * problem)
+{
+	print_line(STDERR_FILENO, "our_malloc: %s(%p): %s\n", operation, ptr, problem);
+	abort();
+}
+
+/*
+* Checks that ptr is a block in use, before it is freed or resized.
+* The header is looked at only once ptr is known to be in the heap.
+*/
+static void check_block(const char * operation, void * ptr)
+{
+	meta_info * block = block_of(ptr);
+
+	if ( (uintptr_t) ptr % ALIGNMENT_SIZE_FOR_MALLOC != 0 || block < global_base || block >= epilogue )
+		report(operation, ptr, "invalid pointer");
+
+	if ( block->size & BLOCK_FREE )
+		report(operation, ptr, "double free");
+
+	if ( BLOCK_SIZE(block) < MINIMUM_BLOCK_SIZE || BLOCK_SIZE(block) > (size_t) ((char*)epilogue - (char*)block) )
+		report(operation, ptr, "corrupted header");
+
+	if ( *canary_of(ptr) == ~canary_value(ptr) )
+		report(operation, ptr, "double free");
+
+	if ( *canary_of(ptr) != canary_value(ptr) )
+		report(operation, ptr, "corrupted canary");
+}
+
+static int is_poisoned(unsigned char * bytes, size_t size)
+{
+	size_t i;
+
+	for ( i = 0; i < size; i++ )
+		if ( bytes[i] != QUARANTINE_POISON )
+			return 0;
+
+	return 1;
+}
+
+// Frees the oldest block in the quarantine
+static void quarantine_leave()
+{
+	void * ptr = quarantine[quarantine_head];
+	size_t size = usable_size(ptr);
+
+	quarantine_head = (quarantine_head + 1) % QUARANTINE_SLOTS;
+	quarantine_length--;
+	quarantine_bytes -= size;
+
+	if ( *canary_of(ptr) != ~canary_value(ptr) || !is_poisoned(ptr, size) )
+		report("free", ptr, "written after free");
+
+	release(ptr);
+}
+
+/*
+* Frees a block that has been checked. Its canary is inverted and,
+* if there is room, it waits in the quarantine.
+*/
+static void checked_release(void * ptr)
+{
+	size_t size = usable_size(ptr);
+
+	*canary_of(ptr) = ~canary_value(ptr);
+
+	if ( size > quarantine_limit ) {
+		release(ptr);
+		return;
+	}
+
+	memset(ptr, QUARANTINE_POISON, size);
+
+	while ( quarantine_length == QUARANTINE_SLOTS || quarantine_bytes + size > quarantine_limit )
+		quarantine_leave();
+
+	quarantine[(quarantine_head + quarantine_length) % QUARANTINE_SLOTS] = ptr;
+	quarantine_length++;
+	quarantine_bytes += size;
+}
+
+// Frees the old block of a realloc as free() does, poisoned and held back if checking
+static void release_reallocated(void * ptr)
+{
+	if ( checking )
+		checked_release(ptr);
+	else
+		release(ptr);
+}
+
+/*
+* Walks the heap from the bottom up: the sizes must lead to the
+* epilogue, free blocks end in their footer, are in a bin and never
+* next to each other, the flags agree with the neighbours, and when
+* checking every block in use has its canary or, if freed and in the
+* quarantine, the inverted one.
+*/
+void malloc_check_heap()
+{
+	meta_info * walk;
+	size_t previous_free = 0;
+	size_t index;
+
+	for ( walk = global_base; walk != NULL && walk != epilogue; walk = NEXT_BLOCK(walk) ) {
+		size_t size = BLOCK_SIZE(walk);
+		void * ptr = (char*)walk + sizeof(meta_info);
+
+		if ( size < MINIMUM_BLOCK_SIZE || size > (size_t) ((char*)epilogue - (char*)walk) )
+			report("malloc_check_heap", ptr, "corrupted header");
+
+		if ( (walk->size & PREV_BLOCK_FREE) != previous_free )
+			report("malloc_check_heap", ptr, "corrupted header");
+
+		if ( walk->size & BLOCK_FREE ) {
+			if ( previous_free )
+				report("malloc_check_heap", ptr, "free blocks not merged");
+
+			if ( *FOOTER(walk, size) != size )
+				report("malloc_check_heap", ptr, "corrupted free block");
+		} else if ( checking && !(walk->size & FOREIGN_BLOCK) ) {
+			if ( *canary_of(ptr) != canary_value(ptr) && *canary_of(ptr) != ~canary_value(ptr) )
+				report("malloc_check_heap", ptr, "corrupted canary");
+		}
+
+		previous_free = walk->size & BLOCK_FREE ? PREV_BLOCK_FREE : 0;
+	}
+
+	if ( epilogue != NULL && (epilogue->size & PREV_BLOCK_FREE) != previous_free )
+		report("malloc_check_heap", epilogue, "corrupted epilogue");
+
+	// A link is followed only once it is known to point into the heap
+	for ( index = 0; index < NUMBER_OF_BINS; index++ ) {
+		meta_info * previous = NULL;
+
+		for ( walk = bins[index]; walk != NULL; previous = walk, walk = FREE_LINKS(walk)->next_free ) {
+			if ( walk < global_base || walk >= epilogue || !(walk->size & BLOCK_FREE) || bin_index(BLOCK_SIZE(walk)) != index )
+				report("malloc_check_heap", walk, "corrupted bin");
+
+			if ( FREE_LINKS(walk)->prev_free != previous )
+				report("malloc_check_heap", walk, "corrupted bin");
+		}
+	}
+}
+
+typedef struct heap_map_writer {
+	int fd;
+	size_t length;
+	malloc_heap_map_record records[HEAP_MAP_BUFFER_RECORDS];
+} heap_map_writer;
+
+static void heap_map_flush(heap_map_writer * writer)
+{
+	char * data = (char*) writer->records;
+	size_t left = writer->length * sizeof(malloc_heap_map_record);
+
+	while ( left > 0 ) {
+		ssize_t written = write(writer->fd, data, left);
+
+		if ( written <= 0 )
+			break;
+
+		data += written;
+		left -= written;
+	}
+
+	writer->length = 0;
+}
+
+static void heap_map_add(heap_map_writer * writer, uint32_t kind, uint32_t order, uint64_t offset, uint64_t size)
+{
+	malloc_heap_map_record * record = &writer->records[writer->length++];
+
+	record->kind = kind;
+	record->order = order;
+	record->offset = offset;
+	record->size = size;
+
+	if ( writer->length == HEAP_MAP_BUFFER_RECORDS )
+		heap_map_flush(writer);
+}
+
+/*
+* The heap is one region, every block in it is recorded with the bin
+* its size falls in, blocks over foreign memory as in use.
+*/
+void malloc_dump_heap(int fd)
+{
+	heap_map_writer writer;
+	meta_info * walk;
+
+	writer.fd = fd;
+	writer.length = 0;
+
+	heap_map_add(&writer, MALLOC_HEAP_MAP_START, MALLOC_HEAP_MAP_LIST, 0, heap_size());
+
+	if ( global_base != NULL ) {
+		heap_map_add(&writer, MALLOC_HEAP_MAP_REGION, 0, (uintptr_t) global_base, heap_size());
+
+		for ( walk = global_base; walk != epilogue && BLOCK_SIZE(walk) > 0; walk = NEXT_BLOCK(walk) ) {
+			size_t size = BLOCK_SIZE(walk);
+
+			uint32_t kind = walk->size & BLOCK_FREE ? MALLOC_HEAP_MAP_FREE : MALLOC_HEAP_MAP_USED;
+
+			heap_map_add(&writer, kind, bin_index(size), (char*) walk - (char*) global_base, size);
+		}
+	}
+
+	heap_map_flush(&writer);
+}
+
+static void request_heap_map(int number)
+{
+	(void) number;
+	heap_map_requested = 1;
+}
+
+void * calloc(size_t count, size_t size)
+{
+
+#ifdef WRITE_LIFTED
+	setvbuf(stderr, NULL, _IONBF, 0);
+	fprintf(stderr, "lifted (so far): %d\n", page_source_extend(0) - start);
+#endif
+
+#ifdef DEBUG_OUR_MALLOC
+	//printf("CALLOC CALLED\n");
+#endif
+
+	size_t total;
+	char * request = NULL;
+
+	if ( __builtin_mul_overflow(count, size, &total) ) {
+		total = SIZE_MAX;
+		errno = ENOMEM;
+	} else {
+		fresh_memory = NULL;
+		request = allocate(checks_on() ? with_canary(total) : total);
+	}
+
+	if ( request != NULL ) {
+		// A block from new pages is only cleared up to them
+		char * end = request + total;
+
+		if ( fresh_memory != NULL && fresh_memory < end )
+			end = fresh_memory > request ? fresh_memory : request;
+
+		memset(request, 0, end - request);
+		arm(request);
+	}
+
+	record_call(MALLOC_TRACE_CALLOC, NULL, total, request);
+	return request;
+}
+
+/*
+* Tries to make the block at ptr fit 'size' bytes without moving it.
+* A block shrinks by splitting off its tail, and grows by absorbing
+* the free block above it, or by moving the break if it is the
+* uppermost block. Returns 1 on success.
+*/
+static int resize_in_place(void * ptr, size_t size_requested)
+{
+	meta_info * block = (meta_info*) ((char*)ptr - sizeof(meta_info));
+	size_t size = align_this_size(size_requested + sizeof(meta_info));
+	size_t current = BLOCK_SIZE(block);
+	size_t flags = block->size & PREV_BLOCK_FREE;
+	meta_info * next = NEXT_BLOCK(block);
+
+	if ( size < size_requested )
+		return 0;
+
+	if ( size < MINIMUM_BLOCK_SIZE )
+		size = MINIMUM_BLOCK_SIZE;
+
+	if ( size > current ) {
+
+		if ( next->size & BLOCK_FREE && current + BLOCK_SIZE(next) >= size ) {
+			// Take the free block upstairs
+			remove_from_bin(next);
+			current += BLOCK_SIZE(next);
+			NEXT_BLOCK(next)->size &= ~(size_t) PREV_BLOCK_FREE;
+			merges++;
+		} else if ( next == epilogue && page_source_extend(0) == (char*)epilogue + sizeof(meta_info) ) {
+			// We are the uppermost block, move the break
+			if ( page_source_extend(size - current) == (void*) -1 )
+				return 0;
+
+			current = size;
+			epilogue = (meta_info*) ((char*)block + size);
+			epilogue->size = 0;
+
+			count_heap_growth();
+		} else {
+			return 0;
+		}
+
+	}
+
+	if ( current >= size + MINIMUM_BLOCK_SIZE ) {
+		// Give back the tail, merging it with what is above
+		meta_info * tail = (meta_info*) ((char*)block + size);
+
+		block->size = size | flags;
+		tail->size = current - size;
+		release((void*)tail + sizeof(meta_info));
+		splits++;
+	} else {
+		block->size = current | flags;
+	}
+
+	return 1;
+}
+
+static void * reallocate(void * ptr, size_t size)
+{
+
+	if ( ptr == NULL ) {
+		// realloc(NULL, size) should be identical to malloc(size)
+		return allocate(size);
+	} else if ( size == 0 ) {
+		// If size is zero and ptr is not NULL, a new, minimum sized object is
+    	// allocated and the original object is freed.
+		release_reallocated(ptr);
+		return allocate(100); // lets say 10 is our minimum size object.
+	}
+
+	if ( resize_in_place(ptr, size) ) {
+		reallocs_in_place++;
+		return ptr;
+	}
+
+	void * tmp = allocate(size);
+
+	if ( tmp == NULL )
+		return NULL;
+
+	size_t old_size = BLOCK_SIZE((meta_info*)(ptr-sizeof(meta_info))) - sizeof(meta_info);
+
+	if ( tmp != ptr )
+		memcpy(tmp, ptr, old_size < size ? old_size : size);
+	release_reallocated(ptr);
+
+
+
+	return tmp;
+}
+
+void * realloc(void * ptr, size_t size)
+{
+	void * result;
+
+	if ( checks_on() && ptr != NULL ) {
+		check_block("realloc", ptr);
+
+		// Inverted first, the old block may be freed
+		*canary_of(ptr) = ~canary_value(ptr);
+		// A size of 0 frees the block and gives a new one, as unchecked
+		result = reallocate(ptr, size == 0 ? 0 : with_canary(size));
+		arm(result != NULL || size == 0 ? result : ptr);
+	} else {
+		result = arm(reallocate(ptr, with_canary(size)));
+	}
+
+	record_call(MALLOC_TRACE_REALLOC, ptr, size, result);
+	return result;
+}
+
+size_t realloc_in_place_count()
+{
+	return reallocs_in_place;
+}
+
+/*
+* Returns 'size' bytes aligned to 'alignment', a power of two. A block
+* with room to spare is cut in three: the part before the aligned
+* payload and the tail after it are given back as free blocks.
+*/
+static void * aligned_allocate(size_t alignment, size_t size)
+{
+	if ( alignment <= ALIGNMENT_SIZE_FOR_MALLOC )
+		return allocate(size);
+
+	size_t padded = size + alignment + MINIMUM_BLOCK_SIZE;
+
+	if ( padded < size ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	char * ptr = allocate(padded);
+
+	if ( ptr == NULL )
+		return NULL;
+
+	uintptr_t aligned = ((uintptr_t) ptr + alignment - 1) & ~((uintptr_t) alignment - 1);
+
+	if ( aligned != (uintptr_t) ptr ) {
+		// The part before must be large enough to be a free block
+		if ( aligned - (uintptr_t) ptr < MINIMUM_BLOCK_SIZE )
+			aligned += alignment;
+
+		meta_info * block = (meta_info*) (ptr - sizeof(meta_info));
+		meta_info * aligned_block = (meta_info*) (aligned - sizeof(meta_info));
+		size_t lead = (char*) aligned_block - (char*) block;
+
+		aligned_block->size = BLOCK_SIZE(block) - lead;
+		block->size = lead | (block->size & PREV_BLOCK_FREE);
+		release(ptr);
+		splits++;
+	}
+
+	resize_in_place((void*) aligned, size);
+
+	return (void*) aligned;
+}
+
+static int is_power_of_two(size_t n)
+{
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+int posix_memalign(void ** memptr, size_t alignment, size_t size)
+{
+	if ( !is_power_of_two(alignment) || alignment % sizeof(void*) != 0 )
+		return EINVAL;
+
+	void * result = checks_on() ? arm(aligned_allocate(alignment, with_canary(size))) : aligned_allocate(alignment, size);
+
+	record_call(MALLOC_TRACE_MEMALIGN, (void*) alignment, size, result);
+
+	if ( result == NULL )
+		return ENOMEM;
+
+	*memptr = result;
+	return 0;
+}
+
+void * aligned_alloc(size_t alignment, size_t size)
+{
+	if ( !is_power_of_two(alignment) ) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	void * result = checks_on() ? arm(aligned_allocate(alignment, with_canary(size))) : aligned_allocate(alignment, size);
+
+	record_call(MALLOC_TRACE_MEMALIGN, (void*) alignment, size, result);
+	return result;
+}
+
+void * memalign(size_t alignment, size_t size)
+{
+	return aligned_alloc(alignment, size);
+}
+
+void * valloc(size_t size)
+{
+	return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void * malloc(size_t size)
+{
+	void * result = checks_on() ? arm(allocate(with_canary(size))) : allocate(size);
+
+	record_call(MALLOC_TRACE_MALLOC, NULL, size, result);
+	return result;
+}
+
+void free(void * ptr)
+{
+	if ( ptr == NULL )
+		return;
+
+	record_call(MALLOC_TRACE_FREE, ptr, 0, NULL);
+
+	if ( checking ) {
+		check_block("free", ptr);
+		checked_release(ptr);
+		return;
+	}
+
+	release(ptr);
+}
+
+// The size is not needed, the header is read to merge the block anyway.
+// When checking it must fit the block.
+void free_sized(void * ptr, size_t size)
+{
+	if ( ptr != NULL && checks_on() ) {
+		check_block("free_sized", ptr);
+
+		if ( size > usable_size(ptr) )
+			report("free_sized", ptr, "wrong size");
+	}
+
+	free(ptr);
+}
+
+size_t malloc_usable_size(void * ptr)
+{
+	if ( ptr == NULL )
+		return 0;
+
+	return usable_size(ptr);
+}
+
+/*
+* A malloc_arena hands out memory by moving a pointer up through
+* chunks taken with malloc, and gives it all back at once. The arena
+* itself sits at the start of its first chunk. A request of more than
+* a quarter of a chunk gets a chunk of its own, and the current one
+* goes on being used.
+*/
+#define DEFAULT_ARENA_CHUNK_SIZE	(64 << 10)
+
+typedef struct arena_chunk {
+	struct arena_chunk * next;
+	size_t unused; // keeps what follows aligned
+} arena_chunk;
+
+struct malloc_arena {
+	arena_chunk * chunks; // all but the first, the newest first
+	char * top; // of what was handed out of the current chunk
+	char * end; // of the current chunk
+	size_t chunk_size;
+};
+
+malloc_arena * arena_create(size_t chunk_size)
+{
+	if ( chunk_size == 0 )
+		chunk_size = DEFAULT_ARENA_CHUNK_SIZE;
+
+	if ( chunk_size < 4 * sizeof(malloc_arena) )
+		chunk_size = 4 * sizeof(malloc_arena);
+
+	malloc_arena * arena = malloc(chunk_size);
+
+	if ( arena == NULL )
+		return NULL;
+
+	arena->chunks = NULL;
+	arena->top = (char*) (arena + 1);
+	arena->end = (char*) arena + chunk_size;
+	arena->chunk_size = chunk_size;
+
+	return arena;
+}
+
+// Takes a new chunk for a request that does not fit in the current one
+static void * arena_grow(malloc_arena * arena, size_t size)
+{
+	int own_chunk = size > arena->chunk_size / 4;
+	arena_chunk * chunk = malloc(own_chunk ? sizeof(arena_chunk) + size : arena->chunk_size);
+
+	if ( chunk == NULL )
+		return NULL;
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+
+	if ( !own_chunk ) {
+		arena->top = (char*) (chunk + 1) + size;
+		arena->end = (char*) chunk + arena->chunk_size;
+	}
+
+	return chunk + 1;
+}
+
+void * arena_alloc(malloc_arena * arena, size_t size)
+{
+	if ( size > SIZE_MAX - ALIGNMENT_SIZE_FOR_MALLOC - sizeof(arena_chunk) ) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	size = size == 0 ? ALIGNMENT_SIZE_FOR_MALLOC : (size + ALIGNMENT_SIZE_FOR_MALLOC - 1) & ~((size_t) ALIGNMENT_SIZE_FOR_MALLOC - 1);
+
+	if ( size > (size_t) (arena->end - arena->top) )
+		return arena_grow(arena, size);
+
+	void * ptr = arena->top;
+	arena->top += size;
+
+	return ptr;
+}
+
+void arena_reset(malloc_arena * arena)
+{
+	while ( arena->chunks != NULL ) {
+		arena_chunk * chunk = arena->chunks;
+
+		arena->chunks = chunk->next;
+		free(chunk);
+	}
+
+	arena->top = (char*) (arena + 1);
+	arena->end = (char*) arena + arena->chunk_size;
+}
+
+void arena_destroy(malloc_arena * arena)
+{
+	if ( arena == NULL )
+		return;
+
+	arena_reset(arena);
+	free(arena);
+}
+
+/*
+* Returns the index in the histogram of requests for 'size',
+* the number of significant bits of it.
+*/
+static size_t request_bucket(size_t size)
+{
+	size_t bucket = size == 0 ? 0 : sizeof(unsigned long) * 8 - __builtin_clzl(size);
+
+	if ( bucket >= MALLOC_REQUEST_HISTOGRAM_SIZE )
+		bucket = MALLOC_REQUEST_HISTOGRAM_SIZE - 1;
+
+	return bucket;
+}
+
+static void trace_flush()
+{
+	char * data = (char*) trace_buffer;
+	size_t left = trace_length * sizeof(malloc_trace_record);
+
+	while ( left > 0 ) {
+		ssize_t written = write(trace_fd, data, left);
+
+		if ( written <= 0 )
+			break;
+
+		data += written;
+		left -= written;
+	}
+
+	trace_length = 0;
+}
+
+static void at_exit()
+{
+	if ( trace_fd >= 0 )
+		trace_flush();
+
+	if ( print_statistics_at_exit )
+		malloc_print_statistics(STDERR_FILENO);
+
+	if ( heap_map_fd >= 0 )
+		malloc_dump_heap(heap_map_fd);
+}
+
+static void initialize()
+{
+	char * trace = getenv("OUR_MALLOC_TRACE");
+
+	initialized = 1;
+
+	// Read first, nothing may be handed out before
+	char * check = getenv("OUR_MALLOC_CHECK");
+	char * quarantine_size = getenv("OUR_MALLOC_QUARANTINE");
+	char * interval = getenv("OUR_MALLOC_VALIDATE");
+
+	if ( quarantine_size != NULL )
+		quarantine_limit = strtoul(quarantine_size, NULL, 0);
+
+	if ( interval != NULL )
+		validate_interval = strtoul(interval, NULL, 0);
+
+	if ( check != NULL || quarantine_size != NULL || interval != NULL ) {
+		checking = 1;
+		canary_size = sizeof(uintptr_t);
+		canary_secret = (uintptr_t) &canary_secret ^ getpid();
+
+#ifdef __linux__
+		// 16 random bytes the kernel gives every process
+		uintptr_t * random = (uintptr_t*) getauxval(AT_RANDOM);
+
+		if ( random != NULL )
+			canary_secret = *random;
+#endif
+	}
+
+	if ( trace != NULL )
+		trace_fd = open(trace, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	print_statistics_at_exit = getenv("OUR_MALLOC_STATS") != NULL;
+
+	char * threshold = getenv("OUR_MALLOC_TRIM_THRESHOLD");
+
+	if ( threshold != NULL )
+		trim_threshold = strtoul(threshold, NULL, 0);
+
+	// Only whole pages can be given back
+	if ( trim_threshold != 0 && trim_threshold < TRIM_PAGE_SIZE )
+		trim_threshold = TRIM_PAGE_SIZE;
+
+	char * heap_map = getenv("OUR_MALLOC_HEAP_MAP");
+
+	if ( heap_map != NULL )
+		heap_map_fd = open(heap_map, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if ( heap_map_fd >= 0 ) {
+		struct sigaction action;
+
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = request_heap_map;
+		action.sa_flags = SA_RESTART;
+		sigaction(SIGUSR2, &action, NULL);
+	}
+
+	if ( trace_fd >= 0 || print_statistics_at_exit || heap_map_fd >= 0 )
+		atexit(at_exit);
+}
+
+static void record_call(uint32_t operation, void * pointer, size_t size, void * result)
+{
+	if ( !initialized )
+		initialize();
+
+	calls[operation]++;
+
+	if ( operation != MALLOC_TRACE_FREE )
+		requests[request_bucket(size)]++;
+
+	if ( validate_interval != 0 && ++calls_since_validation == validate_interval ) {
+		calls_since_validation = 0;
+		malloc_check_heap();
+	}
+
+	if ( heap_map_requested ) {
+		heap_map_requested = 0;
+		malloc_dump_heap(heap_map_fd);
+	}
+
+	if ( trace_fd < 0 )
+		return;
+
+	malloc_trace_record * record = &trace_buffer[trace_length++];
+
+	record->operation = operation;
+	record->thread = 0;
+	record->pointer = (uintptr_t) pointer;
+	record->size = size;
+	record->result = (uintptr_t) result;
+
+	if ( trace_length == TRACE_BUFFER_RECORDS )
+		trace_flush();
+}
+
+void malloc_get_statistics(malloc_statistics * statistics)
+{
+	meta_info * walk;
+	size_t index;
+
+	memset(statistics, 0, sizeof(*statistics));
+
+	statistics->heap_size = heap_size();
+	statistics->peak_heap_size = peak_heap_size;
+	statistics->splits = splits;
+	statistics->merges = merges;
+	statistics->number_of_classes = NUMBER_OF_BINS;
+
+	// The blocks of the tree are counted with the bins they would be in
+	for ( walk = global_base; walk != NULL && walk != epilogue; walk = NEXT_BLOCK(walk) ) {
+		if ( (walk->size & BLOCK_FREE) && BLOCK_SIZE(walk) >= TREE_MINIMUM ) {
+			statistics->free_bytes[bin_index(BLOCK_SIZE(walk))] += BLOCK_SIZE(walk);
+
+			if ( BLOCK_SIZE(walk) > statistics->largest_free_block )
+				statistics->largest_free_block = BLOCK_SIZE(walk);
+		}
+	}
+
+	for ( index = 0; index < NUMBER_OF_BINS; index++ ) {
+
+		if ( index < NUMBER_OF_SMALL_BINS )
+			statistics->class_size[index] = index * ALIGNMENT_SIZE_FOR_MALLOC;
+		else
+			statistics->class_size[index] = (size_t) 1 << (index - NUMBER_OF_SMALL_BINS + SMALL_BIN_LIMIT_LOG2);
+
+		for ( walk = bins[index]; walk != NULL; walk = FREE_LINKS(walk)->next_free ) {
+			statistics->free_bytes[index] += BLOCK_SIZE(walk);
+
+			if ( BLOCK_SIZE(walk) > statistics->largest_free_block )
+				statistics->largest_free_block = BLOCK_SIZE(walk);
+		}
+
+		statistics->bytes_free += statistics->free_bytes[index];
+	}
+
+	memcpy(statistics->calls, calls, sizeof(calls));
+	memcpy(statistics->requests, requests, sizeof(requests));
+
+	statistics->bytes_in_use = statistics->heap_size - statistics->bytes_free;
+
+	if ( statistics->bytes_free > 0 )
+		statistics->fragmentation = 1.0 - (double) statistics->largest_free_block / statistics->bytes_free;
+}
+
+/*
+* Formats into a buffer on the stack and writes it,
+* so printing does not allocate.
+*/
+static void print_line(int fd, const char * format, ...)
+{
+	char line[128];
+	va_list arguments;
+
+	va_start(arguments, format);
+	int length = vsnprintf(line, sizeof(line), format, arguments);
+	va_end(arguments);
+
+	if ( length > 0 )
+		write(fd, line, length < (int) sizeof(line) ? length : (int) sizeof(line) - 1);
+}
+
+void malloc_print_statistics(int fd)
+{
+	malloc_statistics statistics;
+	size_t i;
+
+	malloc_get_statistics(&statistics);
+
+	print_line(fd, "placement          %12s\n", placement->name);
+	print_line(fd, "heap size          %12zu\n", statistics.heap_size);
+	print_line(fd, "peak heap size     %12zu\n", statistics.peak_heap_size);
+	print_line(fd, "bytes in use       %12zu\n", statistics.bytes_in_use);
+	print_line(fd, "bytes free         %12zu\n", statistics.bytes_free);
+	print_line(fd, "largest free block %12zu\n", statistics.largest_free_block);
+	print_line(fd, "fragmentation      %12.3f\n", statistics.fragmentation);
+	print_line(fd, "splits             %12zu\n", statistics.splits);
+	print_line(fd, "merges             %12zu\n", statistics.merges);
+	print_line(fd, "calls              malloc %zu calloc %zu realloc %zu memalign %zu free %zu\n",
+		statistics.calls[MALLOC_TRACE_MALLOC], statistics.calls[MALLOC_TRACE_CALLOC],
+		statistics.calls[MALLOC_TRACE_REALLOC], statistics.calls[MALLOC_TRACE_MEMALIGN],
+		statistics.calls[MALLOC_TRACE_FREE]);
+
+	print_line(fd, "free bytes per bin\n");
+
+	for ( i = 0; i < statistics.number_of_classes; i++ )
+		if ( statistics.free_bytes[i] > 0 )
+			print_line(fd, "  %12zu %12zu\n", statistics.class_size[i], statistics.free_bytes[i]);
+
+	print_line(fd, "requests by size\n");
+
+	for ( i = 0; i < MALLOC_REQUEST_HISTOGRAM_SIZE; i++ )
+		if ( statistics.requests[i] > 0 )
+			print_line(fd, "  < 2^%-7zu %12zu\n", i, statistics.requests[i]);
 }
 
 
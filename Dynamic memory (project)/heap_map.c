@@ -0,0 +1,285 @@
+/*
+* Renders the maps of the heap that malloc_dump_heap() writes: where
+* in the heap the free and the used blocks are, and how the blocks
+* are spread over the orders of the buddy allocator or the bins of
+* the linked list allocator.
+*
+* Writing maps: run a program against either allocator with
+* OUR_MALLOC_HEAP_MAP set. A map is appended at exit, and on the
+* next call after each SIGUSR2:
+*	OUR_MALLOC_HEAP_MAP=gawk.map LD_PRELOAD=./libour_malloc.so gawk -f prog.awk input &
+*	kill -USR2 $!
+*
+* Rendering, with the system malloc:
+*	cc -O2 -I"Buddy (all test passed)" -o heap_map heap_map.c
+*	./heap_map gawk.map		# the last map
+*	./heap_map -n 1 gawk.map	# the first one
+*	./heap_map -s gawk.map		# the summary only
+*	./heap_map -c 65536 gawk.map	# a character for 64 KB, not 4 KB
+*
+* In the bitmap each character stands for the same number of bytes
+* of a region: '.' all free, ':' mostly free, '+' mostly in use,
+* '#' all in use, 's' in use by slab pages.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "our_malloc.h"
+
+#define DEFAULT_CELL_SIZE	4096
+#define CELLS_PER_LINE		64
+// Enough for the 16 orders of the buddy and the 128 bins of the list
+#define MAXIMUM_ORDERS		128
+
+typedef struct order_summary {
+	size_t used;
+	size_t free;
+	size_t slab;
+	size_t free_bytes;
+	size_t smallest; // block of the order or bin
+} order_summary;
+
+static order_summary orders[MAXIMUM_ORDERS];
+
+static int by_address(const void * a, const void * b)
+{
+	const malloc_heap_map_record * x = *(malloc_heap_map_record * const *) a;
+	const malloc_heap_map_record * y = *(malloc_heap_map_record * const *) b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static char cell_character(size_t free, size_t used, size_t slab)
+{
+	size_t total = free + used + slab;
+
+	if ( total == 0 || free == total )
+		return '.';
+
+	if ( free == 0 )
+		return slab > used ? 's' : '#';
+
+	return free * 2 > total ? ':' : '+';
+}
+
+/*
+* Draws the region whose record is at 'records', its blocks follow
+* until the next region or map.
+*/
+static void draw_region(malloc_heap_map_record * records, size_t count, size_t cell_size, int buddy)
+{
+	malloc_heap_map_record * region = records;
+	size_t cells = (region->size + cell_size - 1) / cell_size;
+	size_t cell, i = 1;
+
+	printf("\n%s at 0x%llx, %llu bytes", buddy ? "arena" : "heap", (unsigned long long) region->offset, (unsigned long long) region->size);
+
+	if ( buddy )
+		printf(", node %u", region->order);
+
+	printf("\n");
+
+	for ( cell = 0; cell < cells; cell++ ) {
+		size_t start = cell * cell_size;
+		size_t end = start + cell_size;
+		size_t free = 0, used = 0, slab = 0;
+
+		// The blocks that overlap the cell, some may go on into the next
+		while ( i < count && records[i].kind > MALLOC_HEAP_MAP_REGION ) {
+			size_t from = records[i].offset > start ? records[i].offset : start;
+			size_t to = records[i].offset + records[i].size < end ? records[i].offset + records[i].size : end;
+
+			if ( records[i].offset >= end )
+				break;
+
+			if ( to > from ) {
+				if ( records[i].kind == MALLOC_HEAP_MAP_FREE )
+					free += to - from;
+				else if ( records[i].kind == MALLOC_HEAP_MAP_SLAB )
+					slab += to - from;
+				else
+					used += to - from;
+			}
+
+			if ( records[i].offset + records[i].size > end )
+				break;
+
+			i++;
+		}
+
+		if ( cell % CELLS_PER_LINE == 0 )
+			printf("%10zx ", start);
+
+		putchar(cell_character(free, used, slab));
+
+		if ( cell % CELLS_PER_LINE == CELLS_PER_LINE - 1 || cell == cells - 1 )
+			putchar('\n');
+	}
+}
+
+static void summarize(malloc_heap_map_record * records, size_t count, int buddy)
+{
+	size_t i, order;
+	size_t used_bytes = 0, free_bytes = 0, largest_free = 0, regions = 0;
+	int highest_used = -1;
+
+	memset(orders, 0, sizeof(orders));
+
+	for ( i = 0; i < count; i++ ) {
+		malloc_heap_map_record * record = &records[i];
+
+		if ( record->kind == MALLOC_HEAP_MAP_REGION )
+			regions++;
+
+		if ( record->kind < MALLOC_HEAP_MAP_FREE )
+			continue;
+
+		order_summary * summary = &orders[record->order < MAXIMUM_ORDERS ? record->order : MAXIMUM_ORDERS - 1];
+
+		if ( summary->smallest == 0 || record->size < summary->smallest )
+			summary->smallest = record->size;
+
+		if ( record->kind == MALLOC_HEAP_MAP_FREE ) {
+			summary->free++;
+			summary->free_bytes += record->size;
+			free_bytes += record->size;
+
+			if ( record->size > largest_free )
+				largest_free = record->size;
+		} else {
+			if ( record->kind == MALLOC_HEAP_MAP_SLAB )
+				summary->slab++;
+			else
+				summary->used++;
+
+			used_bytes += record->size;
+
+			if ( (int) record->order > highest_used )
+				highest_used = record->order;
+		}
+	}
+
+	printf("\n%6s %12s %10s %10s %10s %14s %8s\n", buddy ? "order" : "bin", buddy ? "block size" : "from size", "used", "slab", "free", "free bytes", "of free");
+
+	for ( order = 0; order < MAXIMUM_ORDERS; order++ ) {
+		order_summary * summary = &orders[order];
+
+		if ( summary->smallest == 0 )
+			continue;
+
+		printf("%6zu %12zu %10zu %10zu %10zu %14zu %7.1f%%\n", order, summary->smallest, summary->used, summary->slab, summary->free, summary->free_bytes,
+			free_bytes > 0 ? 100.0 * summary->free_bytes / free_bytes : 0.0);
+	}
+
+	printf("\nregions            %12zu\n", regions);
+	printf("bytes in use       %12zu\n", used_bytes);
+	printf("bytes free         %12zu\n", free_bytes);
+	printf("largest free block %12zu\n", largest_free);
+
+	if ( free_bytes > 0 )
+		printf("fragmentation      %12.3f\n", 1.0 - (double) largest_free / free_bytes);
+
+	if ( highest_used >= 0 )
+		printf("%-18s %12d\n", buddy ? "highest order used" : "highest bin used", highest_used);
+}
+
+int main(int argc, char * argv[])
+{
+	size_t cell_size = DEFAULT_CELL_SIZE;
+	long wanted = 0; // the last map
+	int summary_only = 0;
+	int option;
+
+	while ( (option = getopt(argc, argv, "n:c:s")) != -1 ) {
+		switch ( option ) {
+		case 'n':
+			wanted = atol(optarg);
+			break;
+		case 'c':
+			cell_size = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			summary_only = 1;
+			break;
+		default:
+			optind = argc;
+		}
+	}
+
+	if ( optind != argc - 1 || cell_size == 0 ) {
+		fprintf(stderr, "usage: %s [-n map] [-c bytes per character] [-s] file\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	struct stat status;
+
+	if ( fd < 0 || fstat(fd, &status) < 0 ) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	size_t count = status.st_size / sizeof(malloc_heap_map_record);
+	malloc_heap_map_record * records = count == 0 ? MAP_FAILED : mmap(NULL, status.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+	if ( records == MAP_FAILED ) {
+		fprintf(stderr, "%s: no map\n", argv[optind]);
+		return 1;
+	}
+
+	// Find the map asked for
+	size_t i, start = count, end = count;
+	long maps = 0;
+
+	for ( i = 0; i < count; i++ )
+		if ( records[i].kind == MALLOC_HEAP_MAP_START )
+			maps++;
+
+	if ( wanted <= 0 )
+		wanted = maps;
+
+	for ( i = 0, maps = 0; i < count; i++ ) {
+		if ( records[i].kind != MALLOC_HEAP_MAP_START )
+			continue;
+
+		if ( ++maps == wanted )
+			start = i;
+		else if ( maps == wanted + 1 )
+			end = i;
+	}
+
+	if ( start == count ) {
+		fprintf(stderr, "%s: has %ld maps\n", argv[optind], maps);
+		return 1;
+	}
+
+	int buddy = records[start].order == MALLOC_HEAP_MAP_BUDDY;
+
+	printf("map %ld of %ld, %s allocator, heap %llu bytes\n", wanted, maps, buddy ? "buddy" : "linked list", (unsigned long long) records[start].size);
+
+	if ( !summary_only ) {
+		// The regions in address order, each with its blocks
+		malloc_heap_map_record ** regions = malloc((end - start) * sizeof(*regions));
+		size_t number_of_regions = 0;
+
+		for ( i = start + 1; i < end; i++ )
+			if ( records[i].kind == MALLOC_HEAP_MAP_REGION )
+				regions[number_of_regions++] = &records[i];
+
+		qsort(regions, number_of_regions, sizeof(*regions), by_address);
+
+		for ( i = 0; i < number_of_regions; i++ )
+			draw_region(regions[i], &records[end] - regions[i], cell_size, buddy);
+
+		free(regions);
+	}
+
+	summarize(&records[start + 1], end - start - 1, buddy);
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "page_source.h"
+
+// Everything the mmap sources do is in whole pages of this size
+#define PAGE_SIZE_OF_SOURCE		4096
+
+#define HUGE_PAGE_SIZE			(2 << 20)
+
+/*
+* The virtual range reserved by the mmap sources. Reserving costs
+* no memory, pages are only committed as the top moves over them.
+*/
+#define DEFAULT_RESERVATION		((size_t) 64 << 30)
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE			0
+#endif
+
+typedef struct page_source {
+	const char * name;
+	void * (*extend)(intptr_t increment);
+} page_source;
+
+static const page_source * source = NULL;
+
+static char * reservation_base = NULL;
+static char * reservation_top; // the break of the reserved range
+static char * reservation_end;
+
+static uintptr_t round_to_page(uintptr_t address)
+{
+	return (address + PAGE_SIZE_OF_SOURCE - 1) & ~((uintptr_t) PAGE_SIZE_OF_SOURCE - 1);
+}
+
+/*
+* Reserves the range, inaccessible until committed, with the
+* start aligned to 'alignment'. Returns 0 on failure.
+*/
+static int reserve(size_t alignment)
+{
+	size_t length = DEFAULT_RESERVATION;
+	char * requested = getenv("OUR_MALLOC_RESERVE");
+
+	if ( requested != NULL )
+		length = round_to_page(strtoul(requested, NULL, 0));
+
+	char * range = mmap(NULL, length + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+
+	if ( range == MAP_FAILED )
+		return 0;
+
+	uintptr_t offset = (uintptr_t) range & (alignment - 1);
+	size_t head = offset == 0 ? 0 : alignment - offset;
+
+	// Give back what is outside of the aligned range
+	if ( head > 0 )
+		munmap(range, head);
+	munmap(range + head + length, alignment - head);
+
+	reservation_base = range + head;
+	reservation_top = reservation_base;
+	reservation_end = reservation_base + length;
+
+	return 1;
+}
+
+/*
+* Moves the top of the reserved range. Pages it moves over are
+* made accessible, the kernel backs them when first written.
+* Pages it moves back over are freed and made inaccessible.
+*/
+static void * reserved_extend(intptr_t increment)
+{
+	if ( reservation_base == NULL && !reserve(PAGE_SIZE_OF_SOURCE) ) {
+		errno = ENOMEM;
+		return (void*) -1;
+	}
+
+	if ( increment > reservation_end - reservation_top || -increment > reservation_top - reservation_base ) {
+		errno = ENOMEM;
+		return (void*) -1;
+	}
+
+	char * old_top = reservation_top;
+	char * from = (char*) round_to_page((uintptr_t) old_top);
+	char * to = (char*) round_to_page((uintptr_t) (old_top + increment));
+
+	if ( to > from ) {
+		if ( mprotect(from, to - from, PROT_READ | PROT_WRITE) != 0 ) {
+			errno = ENOMEM;
+			return (void*) -1;
+		}
+	} else if ( to < from ) {
+		madvise(to, from - to, MADV_DONTNEED);
+		mprotect(to, from - to, PROT_NONE);
+	}
+
+	reservation_top = old_top + increment;
+	return old_top;
+}
+
+/*
+* As reserved_extend(), with the range aligned to huge pages and
+* marked so that the kernel backs it with them where it can.
+*/
+static void * huge_extend(intptr_t increment)
+{
+	if ( reservation_base == NULL ) {
+		if ( !reserve(HUGE_PAGE_SIZE) ) {
+			errno = ENOMEM;
+			return (void*) -1;
+		}
+
+#ifdef MADV_HUGEPAGE
+		madvise(reservation_base, reservation_end - reservation_base, MADV_HUGEPAGE);
+#endif
+	}
+
+	return reserved_extend(increment);
+}
+
+static void * break_extend(intptr_t increment)
+{
+	return sbrk(increment);
+}
+
+static const page_source sources[] = {
+	{ "sbrk", break_extend },
+	{ "mmap", reserved_extend },
+	{ "huge", huge_extend }
+};
+
+#define NUMBER_OF_SOURCES		(sizeof(sources) / sizeof(sources[0]))
+
+static void choose_source()
+{
+	char * name = getenv("OUR_MALLOC_PAGE_SOURCE");
+	size_t i;
+
+#ifdef __APPLE__
+	// sbrk is emulated with a small fixed region on Mach
+	source = &sources[1];
+#else
+	source = &sources[0];
+#endif
+
+	for ( i = 0; name != NULL && i < NUMBER_OF_SOURCES; i++ )
+		if ( strcmp(name, sources[i].name) == 0 )
+			source = &sources[i];
+}
+
+void * page_source_extend(intptr_t increment)
+{
+	if ( source == NULL )
+		choose_source();
+
+	return source->extend(increment);
+}
+
+const char * page_source_name()
+{
+	return source != NULL ? source->name : "none";
+}
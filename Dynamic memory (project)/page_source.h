@@ -0,0 +1,26 @@
+#ifndef PAGE_SOURCE_H
+#define PAGE_SOURCE_H
+
+#include <stdint.h>
+
+/*
+* Where the allocators get their memory from. The heap is one range
+* that grows and shrinks at its top, and page_source_extend() works
+* like sbrk(): it moves the top by 'increment' bytes and returns the
+* old top, or (void*) -1 with errno set.
+*
+* The source is picked with OUR_MALLOC_PAGE_SOURCE the first time
+* memory is asked for:
+*	sbrk	the program break (the default, except on Mach)
+*	mmap	a range reserved up front, committed as the top grows
+*	huge	as mmap, backed by transparent huge pages
+* The size of the reserved range is set with OUR_MALLOC_RESERVE.
+*
+* Callers must not call it from more than one thread at a time.
+*/
+void * page_source_extend(intptr_t increment);
+
+// Name of the source in use, "none" before the first call
+const char * page_source_name();
+
+#endif
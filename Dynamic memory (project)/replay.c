@@ -0,0 +1,314 @@
+/*
+* Replays a trace of malloc/free/realloc/calloc calls against an
+* allocator and reports the time per call, the peak RSS and how much
+* of the heap was wasted at its peak.
+*
+* Recording a trace: build an allocator as a shared library and
+* run gawk (or anything else) with OUR_MALLOC_TRACE set:
+*	cc -O2 -fno-builtin -pthread -shared -fPIC -o libour_malloc.so "Buddy (all test passed)/our_malloc.c" page_source.c
+*	OUR_MALLOC_TRACE=gawk.trace LD_PRELOAD=./libour_malloc.so gawk -f prog.awk input
+* or link our_malloc.o into gawk as for the test suite and set
+* OUR_MALLOC_TRACE when running it.
+*
+* Replaying, one binary per allocator:
+*	cc -O2 -fno-builtin -pthread -I"Buddy (all test passed)" -o replay_buddy replay.c "Buddy (all test passed)/our_malloc.c" page_source.c
+*	cc -O2 -fno-builtin -I"Linked List Impl (all test passed)" -o replay_list replay.c "Linked List Impl (all test passed)/our_malloc.c" page_source.c
+*	cc -O2 -DREPLAY_SYSTEM_MALLOC -I"Buddy (all test passed)" -o replay_glibc replay.c
+*	./replay_buddy gawk.trace
+*
+* The trace is replayed in the order it was recorded, by one thread.
+* The replay keeps its own data in anonymous mappings so that only
+* the calls of the trace go through the allocator under test.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#ifdef REPLAY_SYSTEM_MALLOC
+#include <malloc.h>
+#endif
+
+#include "our_malloc.h"
+
+#define NO_BLOCK		((uint32_t) -1)
+
+// New memory is written once per page, as a program would
+#define TOUCH_STRIDE		4096
+
+/*
+* A call of the trace, with the pointers replaced by the
+* numbers of the blocks they refer to.
+*/
+typedef struct replay_call {
+	uint32_t operation;
+	uint32_t block; // argument of free and realloc
+	uint32_t result; // block returned
+	uint32_t alignment; // of memalign
+	uint64_t size;
+} replay_call;
+
+/*
+* Maps the pointers of the trace to block numbers while the trace
+* is translated. Open addressing, deleted entries are tombstones.
+*/
+#define EMPTY_KEY		0
+#define DELETED_KEY		1
+
+typedef struct pointer_entry {
+	uint64_t pointer;
+	uint32_t block;
+} pointer_entry;
+
+static pointer_entry * pointers;
+static size_t pointers_mask;
+
+static void * map_memory(size_t length)
+{
+	void * memory = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if ( memory == MAP_FAILED ) {
+		perror("mmap");
+		exit(1);
+	}
+
+	return memory;
+}
+
+static pointer_entry * find_pointer(uint64_t pointer, int insert)
+{
+	size_t index = (pointer >> 4) * 0x9e3779b97f4a7c15ULL & pointers_mask;
+	pointer_entry * free_entry = NULL;
+
+	while ( pointers[index].pointer != EMPTY_KEY ) {
+		if ( pointers[index].pointer == pointer )
+			return &pointers[index];
+
+		if ( pointers[index].pointer == DELETED_KEY && free_entry == NULL )
+			free_entry = &pointers[index];
+
+		index = (index + 1) & pointers_mask;
+	}
+
+	if ( !insert )
+		return NULL;
+
+	return free_entry != NULL ? free_entry : &pointers[index];
+}
+
+static uint32_t take_pointer(uint64_t pointer)
+{
+	pointer_entry * entry = find_pointer(pointer, 0);
+
+	if ( pointer == 0 || entry == NULL )
+		return NO_BLOCK;
+
+	entry->pointer = DELETED_KEY;
+	return entry->block;
+}
+
+static void add_pointer(uint64_t pointer, uint32_t block)
+{
+	pointer_entry * entry = find_pointer(pointer, 1);
+
+	entry->pointer = pointer;
+	entry->block = block;
+}
+
+/*
+* Turns the records of a trace into calls on block numbers.
+* Frees of pointers the trace never returned are dropped.
+* Returns the number of calls, and the number of blocks in *blocks.
+*/
+static size_t translate(malloc_trace_record * records, size_t count, replay_call * calls, size_t * blocks)
+{
+	size_t i, n = 0;
+	uint32_t next_block = 0;
+
+	for ( pointers_mask = 1; pointers_mask < 2 * count; pointers_mask <<= 1 )
+		;
+
+	pointers = map_memory(pointers_mask * sizeof(pointer_entry));
+	pointers_mask -= 1;
+
+	for ( i = 0; i < count; i++ ) {
+		malloc_trace_record * record = &records[i];
+		replay_call * call = &calls[n];
+
+		call->operation = record->operation;
+		call->size = record->size;
+		call->block = NO_BLOCK;
+		call->result = NO_BLOCK;
+		call->alignment = record->operation == MALLOC_TRACE_MEMALIGN ? record->pointer : 0;
+
+		if ( record->operation == MALLOC_TRACE_FREE || record->operation == MALLOC_TRACE_REALLOC ) {
+			call->block = take_pointer(record->pointer);
+
+			if ( call->block == NO_BLOCK && record->operation == MALLOC_TRACE_FREE )
+				continue;
+		}
+
+		if ( record->result != 0 ) {
+			call->result = next_block++;
+			add_pointer(record->result, call->result);
+		}
+
+		n++;
+	}
+
+	*blocks = next_block;
+	return n;
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void touch(char * block, size_t size)
+{
+	size_t offset;
+
+	for ( offset = 0; offset < size; offset += TOUCH_STRIDE )
+		block[offset] = 1;
+}
+
+#ifdef REPLAY_SYSTEM_MALLOC
+static size_t heap_size()
+{
+	struct mallinfo2 info = mallinfo2();
+	return info.arena + info.hblkhd;
+}
+#endif
+
+int main(int argc, char * argv[])
+{
+	if ( argc != 2 ) {
+		fprintf(stderr, "usage: %s trace\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	struct stat status;
+
+	if ( fd < 0 || fstat(fd, &status) < 0 ) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	size_t count = status.st_size / sizeof(malloc_trace_record);
+
+	if ( count == 0 ) {
+		fprintf(stderr, "%s: empty trace\n", argv[1]);
+		return 1;
+	}
+
+	malloc_trace_record * records = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if ( records == MAP_FAILED ) {
+		perror("mmap");
+		return 1;
+	}
+
+	replay_call * calls = map_memory(count * sizeof(replay_call));
+	size_t number_of_blocks;
+	size_t number_of_calls = translate(records, count, calls, &number_of_blocks);
+
+	char ** blocks = map_memory((number_of_blocks + 1) * sizeof(char*));
+	size_t * sizes = map_memory((number_of_blocks + 1) * sizeof(size_t));
+
+	size_t live = 0, peak_live = 0, peak_heap = 0;
+	double sampling = 0;
+	double start = now_ns();
+	size_t i;
+
+	for ( i = 0; i < number_of_calls; i++ ) {
+		replay_call * call = &calls[i];
+		char * result = NULL;
+		size_t old_size = 0;
+
+		switch ( call->operation ) {
+		case MALLOC_TRACE_MALLOC:
+			result = malloc(call->size);
+			break;
+		case MALLOC_TRACE_CALLOC:
+			result = calloc(1, call->size);
+			break;
+		case MALLOC_TRACE_REALLOC:
+			result = realloc(call->block == NO_BLOCK ? NULL : blocks[call->block], call->size);
+			break;
+		case MALLOC_TRACE_MEMALIGN:
+			result = aligned_alloc(call->alignment, call->size);
+			break;
+		case MALLOC_TRACE_FREE:
+			free(blocks[call->block]);
+			break;
+		}
+
+		if ( call->block != NO_BLOCK ) {
+			old_size = sizes[call->block];
+			live -= old_size;
+			blocks[call->block] = NULL;
+		}
+
+		if ( call->result != NO_BLOCK && result != NULL ) {
+			blocks[call->result] = result;
+			sizes[call->result] = call->size;
+			live += call->size;
+
+			// realloc has kept the old contents
+			if ( call->size > old_size )
+				touch(result + old_size, call->size - old_size);
+		}
+
+		if ( live > peak_live )
+			peak_live = live;
+
+#ifdef REPLAY_SYSTEM_MALLOC
+		// After every call that can grow the heap, so the peak is
+		// not missed. mallinfo2 walks the heap, the time it takes
+		// is not counted.
+		if ( call->operation != MALLOC_TRACE_FREE ) {
+			double sample_start = now_ns();
+			size_t size = heap_size();
+
+			if ( size > peak_heap )
+				peak_heap = size;
+
+			sampling += now_ns() - sample_start;
+		}
+#endif
+	}
+
+	double elapsed = now_ns() - start - sampling;
+
+#ifndef REPLAY_SYSTEM_MALLOC
+	malloc_statistics statistics;
+	malloc_get_statistics(&statistics);
+	peak_heap = statistics.peak_heap_size;
+#else
+	if ( heap_size() > peak_heap )
+		peak_heap = heap_size();
+#endif
+
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("calls              %12zu\n", number_of_calls);
+	printf("ns/op              %12.1f\n", elapsed / number_of_calls);
+	printf("peak rss (KB)      %12ld\n", usage.ru_maxrss);
+	printf("peak live bytes    %12zu\n", peak_live);
+	printf("peak heap bytes    %12zu\n", peak_heap);
+
+	if ( peak_heap > 0 )
+		printf("fragmentation      %12.3f\n", 1.0 - (double) peak_live / peak_heap);
+
+	return 0;
+}
@@ -0,0 +1,177 @@
+/*
+* Checks that realloc(ptr, 0) does the same with OUR_MALLOC_CHECK on
+* as with it off: ptr is freed and a new, minimum sized block is
+* returned, not ptr shrunk in place. With the checks on, the old block
+* of a realloc is also checked as free() checks it, and a block
+* shrunk by realloc can be freed with free_sized() of its new size.
+*
+* Build against either allocator, and run with the checks off and on:
+*	cc -O2 -fno-builtin -pthread -I"Buddy (all test passed)" -o test_realloc_buddy test_realloc.c "Buddy (all test passed)/our_malloc.c" page_source.c
+*	cc -O2 -fno-builtin -I"Linked List Impl (all test passed)" -o test_realloc_list test_realloc.c "Linked List Impl (all test passed)/our_malloc.c" page_source.c
+*	./test_realloc_buddy
+*	OUR_MALLOC_CHECK=1 ./test_realloc_buddy
+*	OUR_MALLOC_QUARANTINE=1048576 ./test_realloc_buddy
+*
+* The cases that need the checks, or the quarantine, are skipped
+* without them. Exits with 0 if all that ran passed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "our_malloc.h"
+
+static int failures;
+
+static void expect(int condition, const char * what)
+{
+	if ( !condition ) {
+		printf("FAILED: %s\n", what);
+		failures++;
+	}
+}
+
+// Runs 'step' in a child, what the allocator reports is not shown
+static int run_in_child(void (*step)(void))
+{
+	int status;
+	pid_t child = fork();
+
+	if ( child == 0 ) {
+		int null = open("/dev/null", O_WRONLY);
+
+		dup2(null, STDERR_FILENO);
+		step();
+		_exit(0);
+	}
+
+	waitpid(child, &status, 0);
+	return status;
+}
+
+static int aborts(void (*step)(void))
+{
+	int status = run_in_child(step);
+
+	return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+static int completes(void (*step)(void))
+{
+	int status = run_in_child(step);
+
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Aborts only if the checks are on, the byte changed is the first of the canary
+static void overflow()
+{
+	char * block = malloc(40);
+
+	block[malloc_usable_size(block)] ^= 1;
+	free(block);
+}
+
+/*
+* Frees the block that realloc(ptr, 0) was given. The blocks around
+* it are kept and the new block is larger, so the new one cannot be
+* where the old one was.
+*/
+static void free_after_realloc_to_zero()
+{
+	void * before = malloc(40);
+	void * block = malloc(40);
+	void * after = malloc(40);
+
+	void * result = realloc(block, 0);
+
+	free(block);
+	free(result);
+	free(before);
+	free(after);
+}
+
+/*
+* Writes the old block of a realloc that moved it, then frees enough
+* blocks for the old one to leave the quarantine. The block after it
+* is kept so that it cannot grow in place, and the write is past the
+* words a free block keeps its links in.
+*/
+static void write_after_realloc()
+{
+	char * block = malloc(1000);
+	char * after = malloc(1000);
+	char * moved = realloc(block, 100000);
+	int i;
+
+	block[500] = 1;
+	free(moved);
+	free(after);
+
+	for ( i = 0; i < 10000; i++ )
+		free(malloc(1000));
+}
+
+/*
+* A slab object that realloc shrinks in place must stay in a class
+* that free_sized() finds from the new size, or it is given back to
+* another class and the next malloc of that class crashes.
+*/
+static void shrink_then_free_sized()
+{
+	static char * blocks[4096];
+	int i;
+
+	for ( i = 0; i < 4096; i++ )
+		blocks[i] = realloc(malloc(200), 20);
+
+	// More than a thread cache holds, the rest goes back to the pages
+	for ( i = 0; i < 4096; i++ )
+		free_sized(blocks[i], 20);
+
+	for ( i = 0; i < 4096; i++ )
+		blocks[i] = malloc(20);
+
+	for ( i = 0; i < 4096; i++ )
+		free_sized(blocks[i], 20);
+}
+
+int main()
+{
+	int checking = aborts(overflow);
+
+	// Freed and allocated anew, not resized in place
+	char * block = malloc(1000);
+	size_t in_place = realloc_in_place_count();
+
+	memset(block, 1, 1000);
+	char * result = realloc(block, 0);
+
+	expect(result != NULL, "realloc(ptr, 0) returns a block");
+	expect(realloc_in_place_count() == in_place, "realloc(ptr, 0) does not resize in place");
+	free(result);
+	malloc_check_heap();
+
+	if ( checking )
+		expect(aborts(free_after_realloc_to_zero), "realloc(ptr, 0) frees ptr");
+
+	if ( checking && getenv("OUR_MALLOC_QUARANTINE") != NULL )
+		expect(aborts(write_after_realloc), "the old block of realloc is quarantined");
+
+	expect(completes(shrink_then_free_sized), "free_sized() of a slab object shrunk by realloc");
+
+	// The new block is checked like any other
+	result = realloc(malloc(40), 0);
+	expect(result != NULL, "realloc(ptr, 0) of a small block returns a block");
+	result = realloc(result, 100);
+	expect(result != NULL, "the block of realloc(ptr, 0) can be reallocated");
+	free(result);
+	malloc_check_heap();
+
+	printf("%s%s\n", failures == 0 ? "ok" : "failed", checking ? "" : ", checks skipped");
+	return failures != 0;
+}